@@ -0,0 +1,86 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "kitd.h"
+
+enum { M = 60, H = 60*M, D = 24*H };
+
+// An interval with an optional suffix, in milliseconds without one,
+// returning the rest of the string.
+const char *parseInterval(struct timeval *interval, const char *str) {
+	char *end;
+	unsigned long n = strtoul(str, &end, 10);
+	timerclear(interval);
+	switch (*end) {
+		break; case 's': interval->tv_sec = n; end++;
+		break; case 'm': interval->tv_sec = n*M; end++;
+		break; case 'h': interval->tv_sec = n*H; end++;
+		break; case 'd': interval->tv_sec = n*D; end++;
+		break; default: interval->tv_usec = n * 1000;
+	}
+	interval->tv_sec += interval->tv_usec / 1000000;
+	interval->tv_usec %= 1000000;
+	return end;
+}
+
+void backoffReset(struct Backoff *backoff) {
+	backoff->interval = backoff->restart;
+}
+
+// The delay before restarting a child which ran for uptime. The interval
+// doubles up to the maximum each time, and starts over once a child has
+// stayed up for the cooloff. Without an uptime there is no cooloff.
+struct timeval backoffNext(struct Backoff *backoff, const struct timeval *uptime) {
+	if (uptime && timercmp(uptime, &backoff->cooloff, >=)) {
+		backoffReset(backoff);
+	}
+	struct timeval delay = backoff->interval;
+	timeradd(&backoff->interval, &backoff->interval, &backoff->interval);
+	if (timercmp(&backoff->interval, &backoff->maximum, >)) {
+		backoff->interval = backoff->maximum;
+	}
+	return delay;
+}
+
+// A run of a job succeeded if it exited 0 before its timeout.
+bool runOk(int status, bool timedOut) {
+	return !timedOut && WIFEXITED(status) && !WEXITSTATUS(status);
+}
+
+// What to do once the child has exited. A command that could not be run
+// stops kitd. A job run queued behind this one starts at once, and a job
+// that succeeded waits for its schedule; either way backoff starts over.
+// A planned restart is not a failure, so it leaves backoff alone. Anything
+// else is restarted after the next backoff interval, which for jobs does
+// not cool off.
+enum Restart restartNext(struct Backoff *backoff, const struct Exit *exit, struct timeval *delay) {
+	timerclear(delay);
+	if (exit->stop) return RestartStop;
+	if (WIFEXITED(exit->status) && WEXITSTATUS(exit->status) == 127) {
+		return RestartStop;
+	}
+	if (exit->job && (exit->queued || runOk(exit->status, exit->timedOut))) {
+		backoffReset(backoff);
+		return (exit->queued ? RestartNow : RestartSchedule);
+	}
+	if (exit->planned) return RestartNow;
+	*delay = backoffNext(backoff, (exit->job ? NULL : &exit->uptime));
+	return RestartDelay;
+}
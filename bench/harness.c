@@ -0,0 +1,172 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../kitd.h"
+
+// Stands in for syslogd(8) on a local datagram socket, running kitd with
+// bench/loadgen as its child and timing each line from write to receipt.
+
+enum { Idle = 5000, ArgCap = 32 };
+
+static unsigned long long usec(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static double seconds(struct timeval tv) {
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+	const char *kitd = "./kitd";
+	const char *loadgen = "bench/loadgen";
+	unsigned long lines = 1000000;
+	char flags[ArgCap / 2][3];
+	char *args[ArgCap];
+	size_t len = 0;
+	for (int opt; 0 < (opt = getopt(argc, argv, "b:e:g:k:l:n:r:"));) {
+		switch (opt) {
+			break; case 'g': loadgen = optarg;
+			break; case 'k': kitd = optarg;
+			break; case 'b': case 'e': case 'l': case 'n': case 'r':
+				if (opt == 'n') lines = strtoul(optarg, NULL, 10);
+				if (len == ArgCap) errx(1, "too many options");
+				snprintf(flags[len / 2], sizeof(flags[0]), "-%c", opt);
+				args[len] = flags[len / 2];
+				args[len + 1] = optarg;
+				len += 2;
+			break; default: return 1;
+		}
+	}
+	if (!lines) errx(1, "no lines");
+
+	char dir[] = "/tmp/kitd-bench.XXXXXX";
+	if (!mkdtemp(dir)) err(1, "mkdtemp");
+	char stats[sizeof(dir) + 8];
+	snprintf(stats, sizeof(stats), "%s/stats", dir);
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/log", dir);
+
+	int sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) err(1, "socket");
+	int error = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+	if (error) err(1, "%s", addr.sun_path);
+	int size = 4 * 1024 * 1024;
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	unsigned long long *latency = calloc(lines, sizeof(*latency));
+	if (!latency) err(1, "calloc");
+
+	unsigned long long start = usec();
+	pid_t pid = fork();
+	if (pid < 0) err(1, "fork");
+	if (!pid) {
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		char *argv[16 + ArgCap] = {
+			(char *)kitd, "-d", "-t", "1h", "-n", "bench",
+			"-r", addr.sun_path, "--", (char *)loadgen, "-o", stats,
+		};
+		size_t argc = 12;
+		for (size_t i = 0; i < len; ++i) {
+			argv[argc++] = args[i];
+		}
+		execv(kitd, argv);
+		_exit(127);
+	}
+
+	unsigned long count = 0;
+	unsigned long long bytes = 0;
+	unsigned long long last = start;
+	while (count < lines) {
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+		int ready = poll(&pfd, 1, Idle);
+		if (ready < 0 && errno == EINTR) continue;
+		if (ready < 0) err(1, "poll");
+		if (!ready) break;
+		char buf[64 * 1024 + 1];
+		ssize_t n = recv(sock, buf, sizeof(buf)-1, 0);
+		if (n < 0) err(1, "recv");
+		last = usec();
+		buf[n] = '\0';
+		char *msg = strstr(buf, "@@ ");
+		if (!msg) continue;
+		unsigned long long sent;
+		if (sscanf(msg, "@@ %*u %llu", &sent) != 1) continue;
+		latency[count++] = last - sent;
+		bytes += &buf[n] - msg + 1;
+	}
+
+	kill(pid, SIGTERM);
+	int status;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) < 0) err(1, "wait4");
+
+	// kitd is charged for the child it reaped, so take the child back off.
+	unsigned long long blocked = 0;
+	double childUser = 0, childSys = 0;
+	FILE *file = fopen(stats, "r");
+	if (file) {
+		if (fscanf(file, "%llu %lf %lf", &blocked, &childUser, &childSys) != 3) {
+			warnx("%s: invalid stats", stats);
+		}
+		fclose(file);
+	} else {
+		warn("%s", stats);
+	}
+	unlink(stats);
+	unlink(addr.sun_path);
+	rmdir(dir);
+
+	double user = seconds(usage.ru_utime) - childUser;
+	double sys = seconds(usage.ru_stime) - childSys;
+	double elapsed = (last - start) / 1e6;
+	printf("lines     %lu of %lu\n", count, lines);
+	printf("elapsed   %.3fs\n", elapsed);
+	if (!count) return 1;
+	printf("lines/s   %.0f\n", count / elapsed);
+	printf("bytes/s   %.0f\n", bytes / elapsed);
+	printf(
+		"cpu       %.3fs user %.3fs system, %.3fs per million lines\n",
+		user, sys, (user + sys) * 1e6 / count
+	);
+	struct Percentiles pct;
+	percentiles(&pct, latency, count);
+	printf(
+		"latency   p50 %lluus p90 %lluus p99 %lluus p99.9 %lluus max %lluus\n",
+		pct.p50, pct.p90, pct.p99, pct.p999, pct.max
+	);
+	printf("blocked   %.3fs in write(2)\n", blocked / 1e6);
+	return count < lines;
+}
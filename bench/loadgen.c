@@ -0,0 +1,107 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { LineCap = 64 * 1024 };
+
+static unsigned long long usec(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static unsigned long long blocked;
+
+static void put(int fd, const char *ptr, size_t len) {
+	unsigned long long start = usec();
+	while (len) {
+		ssize_t n = write(fd, ptr, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) err(1, "write");
+		ptr += n;
+		len -= n;
+	}
+	blocked += usec() - start;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned long lines = 1000000;
+	unsigned long rate = 0;
+	unsigned long burst = 1;
+	unsigned long errs = 0;
+	size_t min = 80, max = 80;
+	const char *out = NULL;
+	for (int opt; 0 < (opt = getopt(argc, argv, "b:e:l:n:o:r:"));) {
+		char *end;
+		switch (opt) {
+			break; case 'b': burst = strtoul(optarg, NULL, 10);
+			break; case 'e': errs = strtoul(optarg, NULL, 10);
+			break; case 'l':
+				min = max = strtoul(optarg, &end, 10);
+				if (*end == '-') max = strtoul(&end[1], NULL, 10);
+			break; case 'n': lines = strtoul(optarg, NULL, 10);
+			break; case 'o': out = optarg;
+			break; case 'r': rate = strtoul(optarg, NULL, 10);
+			break; default: return 1;
+		}
+	}
+	if (!burst) burst = 1;
+	if (min > max || max >= LineCap) errx(1, "invalid length");
+
+	static char line[LineCap];
+	memset(line, 'x', sizeof(line));
+	srandom(1);
+
+	// Write bursts of lines back to back, spacing the bursts to keep rate.
+	unsigned long long start = usec();
+	for (unsigned long i = 0; i < lines; ++i) {
+		if (rate && i && !(i % burst)) {
+			unsigned long long due = start + i * 1000000ULL / rate;
+			unsigned long long now = usec();
+			if (due > now) usleep(due - now);
+		}
+		size_t len = min + (max > min ? random() % (max - min + 1) : 0);
+		int head = snprintf(line, sizeof(line), "@@ %lu %llu ", i, usec());
+		if ((size_t)head >= len) len = head;
+		line[head] = 'x';
+		line[len] = '\n';
+		bool err = errs && (unsigned long)random() % 100 < errs;
+		put((err ? STDERR_FILENO : STDOUT_FILENO), line, len + 1);
+		line[len] = 'x';
+	}
+
+	if (!out) return 0;
+	FILE *file = fopen(out, "w");
+	if (!file) err(1, "%s", out);
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	fprintf(
+		file, "%llu %ld.%06ld %ld.%06ld\n", blocked,
+		(long)usage.ru_utime.tv_sec, (long)usage.ru_utime.tv_usec,
+		(long)usage.ru_stime.tv_sec, (long)usage.ru_stime.tv_usec
+	);
+	fclose(file);
+}
@@ -0,0 +1,185 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../kitd.h"
+
+// Measures how quickly kitd restarts its child and forwards signals to it.
+// The child is this program again, reporting timestamps over a pipe.
+
+enum { ReportFd = 3, Timeout = 10 };
+
+static unsigned long long usec(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static void report(int fd, const char *event, int sig) {
+	char buf[64];
+	int len = snprintf(buf, sizeof(buf), "%s %d %llu\n", event, sig, usec());
+	if (write(fd, buf, len) < 0) _exit(1);
+}
+
+static int child(int fd, const char *mode) {
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	report(fd, "start", 0);
+	if (!strcmp(mode, "exit")) {
+		report(fd, "exit", 0);
+		return 0;
+	}
+	for (;;) {
+		int sig;
+		if (sigwait(&mask, &sig)) continue;
+		report(fd, "signal", sig);
+		if (sig == SIGTERM) return 0;
+	}
+}
+
+static const char *kitd = "./kitd";
+static const char *self;
+static FILE *reports;
+static int reportRW[2];
+
+static pid_t spawn(const char *mode) {
+	pid_t pid = fork();
+	if (pid < 0) err(1, "fork");
+	if (pid) return pid;
+	int null = open("/dev/null", O_WRONLY);
+	dup2(null, STDOUT_FILENO);
+	dup2(null, STDERR_FILENO);
+	dup2(reportRW[1], ReportFd);
+	char fd[8];
+	snprintf(fd, sizeof(fd), "%d", ReportFd);
+	execl(
+		kitd, kitd, "-d", "-t", "0", "-n", "react", "--",
+		self, "-c", fd, "-m", mode, NULL
+	);
+	_exit(127);
+}
+
+static unsigned long long expect(const char *event, int sig) {
+	char buf[64];
+	char name[16];
+	int num;
+	unsigned long long time;
+	alarm(Timeout);
+	while (fgets(buf, sizeof(buf), reports)) {
+		if (sscanf(buf, "%15s %d %llu", name, &num, &time) != 3) continue;
+		if (strcmp(name, event) || num != sig) continue;
+		alarm(0);
+		return time;
+	}
+	errx(1, "no %s %d", event, sig);
+}
+
+static void stop(pid_t pid) {
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+// One line per measurement, in microseconds.
+static void print(const char *name, unsigned long long *lat, size_t n) {
+	struct Percentiles pct;
+	percentiles(&pct, lat, n);
+	printf(
+		"%s count=%zu min=%llu p50=%llu p90=%llu p99=%llu max=%llu\n",
+		name, n, pct.min, pct.p50, pct.p90, pct.p99, pct.max
+	);
+}
+
+int main(int argc, char *argv[]) {
+	size_t n = 200;
+	int fd = -1;
+	const char *mode = NULL;
+	for (int opt; 0 < (opt = getopt(argc, argv, "c:k:m:n:"));) {
+		switch (opt) {
+			break; case 'c': fd = strtol(optarg, NULL, 10);
+			break; case 'k': kitd = optarg;
+			break; case 'm': mode = optarg;
+			break; case 'n': n = strtoul(optarg, NULL, 10);
+			break; default: return 1;
+		}
+	}
+	if (fd >= 0 && mode) return child(fd, mode);
+	if (!n) errx(1, "no iterations");
+	self = argv[0];
+
+	int error = pipe(reportRW);
+	if (error) err(1, "pipe");
+	fcntl(reportRW[0], F_SETFD, FD_CLOEXEC);
+	reports = fdopen(reportRW[0], "r");
+	if (!reports) err(1, "fdopen");
+	unsigned long long *lat = calloc(n, sizeof(*lat));
+	if (!lat) err(1, "calloc");
+
+	// Child exit to the next child running, with a restart interval of 0.
+	pid_t pid = spawn("exit");
+	expect("start", 0);
+	for (size_t i = 0; i < n; ++i) {
+		unsigned long long exit = expect("exit", 0);
+		lat[i] = expect("start", 0) - exit;
+	}
+	stop(pid);
+	print("restart", lat, n);
+
+	const struct {
+		const char *name;
+		int sig;
+	} Signals[] = {
+		{ "sighup", SIGHUP },
+		{ "sigusr1", SIGUSR1 },
+		{ "sigusr2", SIGUSR2 },
+	};
+	pid = spawn("wait");
+	expect("start", 0);
+	for (size_t s = 0; s < sizeof(Signals) / sizeof(Signals[0]); ++s) {
+		for (size_t i = 0; i < n; ++i) {
+			unsigned long long sent = usec();
+			kill(pid, Signals[s].sig);
+			lat[i] = expect("signal", Signals[s].sig) - sent;
+		}
+		print(Signals[s].name, lat, n);
+	}
+	stop(pid);
+
+	// SIGTERM stops kitd, so it takes a fresh one each time.
+	for (size_t i = 0; i < n; ++i) {
+		pid = spawn("wait");
+		expect("start", 0);
+		unsigned long long sent = usec();
+		kill(pid, SIGTERM);
+		lat[i] = expect("signal", SIGTERM) - sent;
+		waitpid(pid, NULL, 0);
+	}
+	print("sigterm", lat, n);
+}
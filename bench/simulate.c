@@ -0,0 +1,300 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "../kitd.h"
+
+// Replays exits of a fleet of instances under a virtual clock, through the
+// same restart decision and backoff as kitd, and reports how often they
+// restart and how long they take to recover from an outage. Uptimes are
+// read from a trace file, one interval per line, or drawn at random around
+// a mean.
+
+enum { M = 60, H = 60 * M, D = 24 * H };
+
+// The uptime of children started during the outage.
+static const struct timeval Crash = { .tv_usec = 100000 };
+
+// Every exit is a failure, as the wait status of exit(1).
+enum { Failure = 1 << 8 };
+
+struct Instance {
+	struct Backoff backoff;
+	bool up;
+	bool recovered;
+	size_t trace;
+	struct timeval start;
+	struct timeval event;
+};
+
+static struct Instance *instances;
+static size_t *heap;
+static size_t len;
+
+static struct {
+	struct timeval *uptimes;
+	size_t len;
+	size_t cap;
+} trace;
+
+static struct {
+	bool set;
+	struct timeval start;
+	struct timeval end;
+} outage;
+
+static struct timeval mean = { .tv_sec = H };
+static unsigned long long state = 1;
+
+static unsigned long long next(void) {
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545F4914F6CDD1DULL;
+}
+
+static void interval(struct timeval *interval, const char *str) {
+	if (*parseInterval(interval, str)) errx(1, "invalid interval %s", str);
+}
+
+static void outageParse(const char *str) {
+	const char *end = parseInterval(&outage.start, str);
+	if (*end != '-' || *parseInterval(&outage.end, &end[1])) {
+		errx(1, "invalid outage %s", str);
+	}
+	if (!timercmp(&outage.start, &outage.end, <)) {
+		errx(1, "invalid outage %s", str);
+	}
+	outage.set = true;
+}
+
+static unsigned long long msec(const struct timeval *tv) {
+	return tv->tv_sec * 1000ULL + tv->tv_usec / 1000;
+}
+
+static void traceRead(const char *path) {
+	FILE *file = fopen(path, "r");
+	if (!file) err(1, "%s", path);
+	char buf[64];
+	while (fgets(buf, sizeof(buf), file)) {
+		buf[strcspn(buf, "\n")] = '\0';
+		if (!buf[0] || buf[0] == '#') continue;
+		if (trace.len == trace.cap) {
+			trace.cap = (trace.cap ? trace.cap * 2 : 256);
+			trace.uptimes = realloc(
+				trace.uptimes, trace.cap * sizeof(*trace.uptimes)
+			);
+			if (!trace.uptimes) err(1, "realloc");
+		}
+		interval(&trace.uptimes[trace.len++], buf);
+	}
+	if (ferror(file)) err(1, "%s", path);
+	fclose(file);
+	if (!trace.len) errx(1, "%s: no uptimes", path);
+}
+
+static bool before(size_t a, size_t b) {
+	return timercmp(&instances[heap[a]].event, &instances[heap[b]].event, <);
+}
+
+static void swap(size_t a, size_t b) {
+	size_t x = heap[a];
+	heap[a] = heap[b];
+	heap[b] = x;
+}
+
+static void push(size_t i) {
+	size_t n = len++;
+	heap[n] = i;
+	for (; n && before(n, (n - 1) / 2); n = (n - 1) / 2) {
+		swap(n, (n - 1) / 2);
+	}
+}
+
+static size_t pop(void) {
+	size_t i = heap[0];
+	heap[0] = heap[--len];
+	for (size_t n = 0;;) {
+		size_t min = n;
+		if (2*n + 1 < len && before(2*n + 1, min)) min = 2*n + 1;
+		if (2*n + 2 < len && before(2*n + 2, min)) min = 2*n + 2;
+		if (min == n) break;
+		swap(n, min);
+		n = min;
+	}
+	return i;
+}
+
+// Uptimes come from the trace in turn, or are exponentially distributed.
+static struct timeval uptime(struct Instance *instance) {
+	if (
+		outage.set && !timercmp(&instance->start, &outage.start, <) &&
+		timercmp(&instance->start, &outage.end, <)
+	) {
+		return Crash;
+	}
+	if (trace.len) {
+		return trace.uptimes[instance->trace++ % trace.len];
+	}
+	double r = (next() >> 11) * 0x1p-53;
+	double ms = -log(1 - r) * msec(&mean);
+	struct timeval tv = {
+		.tv_sec = ms / 1000, .tv_usec = fmod(ms, 1000) * 1000,
+	};
+	return tv;
+}
+
+struct Samples {
+	unsigned long long *ptr;
+	size_t len;
+	size_t cap;
+};
+
+static void sample(struct Samples *samples, unsigned long long ms) {
+	if (samples->len == samples->cap) {
+		samples->cap = (samples->cap ? samples->cap * 2 : 1024);
+		samples->ptr = realloc(
+			samples->ptr, samples->cap * sizeof(*samples->ptr)
+		);
+		if (!samples->ptr) err(1, "realloc");
+	}
+	samples->ptr[samples->len++] = ms;
+}
+
+// One line per measurement, in milliseconds.
+static void print(const char *name, struct Samples *samples) {
+	if (!samples->len) {
+		printf("%s count=0\n", name);
+		return;
+	}
+	struct Percentiles pct;
+	percentiles(&pct, samples->ptr, samples->len);
+	printf(
+		"%s count=%zu min=%llu p50=%llu p90=%llu p99=%llu max=%llu\n",
+		name, samples->len, pct.min, pct.p50, pct.p90, pct.p99, pct.max
+	);
+}
+
+int main(int argc, char *argv[]) {
+	size_t n = 1000;
+	struct timeval duration = { .tv_sec = D };
+	struct timeval bucket = { .tv_sec = M };
+	struct Backoff backoff = {
+		.restart = { .tv_sec = 1 },
+		.cooloff = { .tv_sec = 15*M },
+		.maximum = { .tv_sec = 1*H },
+	};
+	for (int opt; 0 < (opt = getopt(argc, argv, "c:d:i:m:n:o:s:t:u:"));) {
+		switch (opt) {
+			break; case 'c': interval(&backoff.cooloff, optarg);
+			break; case 'd': interval(&duration, optarg);
+			break; case 'i': interval(&bucket, optarg);
+			break; case 'm': interval(&backoff.maximum, optarg);
+			break; case 'n': n = strtoul(optarg, NULL, 10);
+			break; case 'o': outageParse(optarg);
+			break; case 's': state = strtoull(optarg, NULL, 10) | 1;
+			break; case 't': interval(&backoff.restart, optarg);
+			break; case 'u': interval(&mean, optarg);
+			break; default: return 1;
+		}
+	}
+	if (!n) errx(1, "no instances");
+	if (!timerisset(&bucket)) errx(1, "invalid bucket interval");
+	if (optind < argc) traceRead(argv[optind]);
+	backoffReset(&backoff);
+
+	size_t buckets = (msec(&duration) + msec(&bucket) - 1) / msec(&bucket);
+	unsigned long long *restarts = calloc(buckets, sizeof(*restarts));
+	instances = calloc(n, sizeof(*instances));
+	heap = calloc(n, sizeof(*heap));
+	if (!restarts || !instances || !heap) err(1, "calloc");
+	// Every instance starts together, at a random point in the trace.
+	for (size_t i = 0; i < n; ++i) {
+		instances[i].backoff = backoff;
+		if (trace.len) instances[i].trace = next() % trace.len;
+		push(i);
+	}
+
+	struct Samples downtime = {0};
+	struct Samples recovery = {0};
+	unsigned long long total = 0;
+	while (len) {
+		size_t i = pop();
+		struct Instance *instance = &instances[i];
+		struct timeval now = instance->event;
+		if (timercmp(&now, &duration, >=)) continue;
+		if (instance->up) {
+			instance->up = false;
+			struct Exit last = { .status = Failure };
+			timersub(&now, &instance->start, &last.uptime);
+			struct timeval delay;
+			if (restartNext(&instance->backoff, &last, &delay) == RestartStop) {
+				continue;
+			}
+			timeradd(&now, &delay, &instance->event);
+			sample(&downtime, msec(&delay));
+		} else {
+			if (timerisset(&now)) {
+				restarts[msec(&now) / msec(&bucket)]++;
+				total++;
+			}
+			if (
+				outage.set && !instance->recovered &&
+				!timercmp(&now, &outage.end, <)
+			) {
+				struct timeval late;
+				timersub(&now, &outage.end, &late);
+				sample(&recovery, msec(&late));
+				instance->recovered = true;
+			}
+			instance->up = true;
+			instance->start = now;
+			struct timeval ran = uptime(instance);
+			timeradd(&now, &ran, &instance->event);
+			// The outage takes down whatever is running.
+			if (
+				outage.set && timercmp(&now, &outage.start, <) &&
+				timercmp(&instance->event, &outage.start, >)
+			) {
+				instance->event = outage.start;
+			}
+		}
+		push(i);
+	}
+
+	unsigned long long peak = 0;
+	for (size_t i = 0; i < buckets; ++i) {
+		if (restarts[i] > peak) peak = restarts[i];
+		printf(
+			"bucket time=%llu restarts=%llu rate=%.2f\n",
+			i * msec(&bucket) / 1000, restarts[i],
+			restarts[i] * 1000.0 / msec(&bucket)
+		);
+	}
+	printf(
+		"restarts total=%llu peak=%llu rate=%.2f\n",
+		total, peak, peak * 1000.0 / msec(&bucket)
+	);
+	print("downtime", &downtime);
+	if (outage.set) print("recovery", &recovery);
+}
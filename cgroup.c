@@ -0,0 +1,223 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kitd.h"
+
+static struct {
+	const char *dir;
+	pid_t child;
+	bool frozen;
+	struct timeval since;
+	bool thawed;
+	struct timeval paused;
+} cgroup;
+
+static struct {
+	bool set;
+	int value;
+	int steady;
+	struct timeval timeout;
+	bool active;
+	struct timeval until;
+} boost;
+
+static int cgroupWrite(const char *name, const char *value) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", cgroup.dir, name);
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) return -1;
+	ssize_t len = write(fd, value, strlen(value));
+	int writeErrno = errno;
+	close(fd);
+	errno = writeErrno;
+	return (len < 0 ? -1 : 0);
+}
+
+// A cgroup v2 directory which the child is moved into.
+void cgroupInit(const char *dir) {
+	cgroup.dir = dir;
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/cgroup.procs", dir);
+	if (access(path, W_OK)) err(1, "%s", path);
+}
+
+// Called in the child before exec, so that everything it starts is in the
+// cgroup too.
+void cgroupJoin(void) {
+	if (!cgroup.dir) return;
+	char pid[16];
+	snprintf(pid, sizeof(pid), "%d", (int)getpid());
+	if (cgroupWrite("cgroup.procs", pid)) warn("%s/cgroup.procs", cgroup.dir);
+}
+
+// CPU time used by everything in the cgroup.
+int cgroupUsage(unsigned long long *usec) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/cpu.stat", cgroup.dir);
+	FILE *file = fopen(path, "re");
+	if (!file) return -1;
+	int n = fscanf(file, "usage_usec %llu", usec);
+	fclose(file);
+	if (n == 1) return 0;
+	errno = EINVAL;
+	return -1;
+}
+
+// Without a cgroup, stop the process group instead, which the child may
+// notice.
+static int freezeSet(bool frozen) {
+	if (cgroup.dir) return cgroupWrite("cgroup.freeze", (frozen ? "1" : "0"));
+	return killpg(cgroup.child, (frozen ? SIGSTOP : SIGCONT));
+}
+
+void freezeFork(pid_t pid) {
+	cgroup.child = pid;
+	cgroup.frozen = false;
+}
+
+// A child killed while frozen leaves the cgroup frozen for the next one.
+void freezeExit(void) {
+	if (cgroup.frozen && freezeSet(false) && errno != ESRCH) {
+		syslog(LOG_WARNING, "thaw: %m");
+	}
+	cgroup.child = 0;
+	cgroup.frozen = false;
+}
+
+bool frozen(void) {
+	return cgroup.frozen;
+}
+
+const char *freeze(void) {
+	if (!cgroup.child) return "no child";
+	if (cgroup.frozen) return "already frozen";
+	if (freezeSet(true)) return strerror(errno);
+	PROBE1(freeze, cgroup.child);
+	cgroup.frozen = true;
+	monotonic(&cgroup.since);
+	syslog(LOG_NOTICE, "child frozen");
+	return NULL;
+}
+
+const char *thaw(void) {
+	if (!cgroup.frozen) return "not frozen";
+	if (freezeSet(false)) return strerror(errno);
+	PROBE1(thaw, cgroup.child);
+	cgroup.frozen = false;
+	struct timeval now;
+	monotonic(&now);
+	timersub(&now, &cgroup.since, &cgroup.paused);
+	cgroup.thawed = true;
+	syslog(LOG_NOTICE, "child thawed");
+	return NULL;
+}
+
+// How long the child was frozen for, once after each thaw, so that timers
+// can be pushed back.
+bool thawed(struct timeval *paused) {
+	if (!cgroup.thawed) return false;
+	cgroup.thawed = false;
+	*paused = cgroup.paused;
+	return true;
+}
+
+bool frozenFor(struct timeval *time) {
+	if (!cgroup.frozen) return false;
+	struct timeval now;
+	monotonic(&now);
+	timersub(&now, &cgroup.since, time);
+	return true;
+}
+
+// The boost is a CPU weight for the cgroup, or otherwise a nice value for
+// the process group. It is dropped back to what it was at startup.
+void boostInit(int value, const struct timeval *timeout) {
+	boost.set = true;
+	boost.value = value;
+	boost.timeout = *timeout;
+	if (!cgroup.dir) {
+		errno = 0;
+		boost.steady = getpriority(PRIO_PROCESS, 0);
+		if (errno) err(1, "getpriority");
+		return;
+	}
+	if (value < 1 || value > 10000) errx(1, "invalid weight %d", value);
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/cpu.weight", cgroup.dir);
+	FILE *file = fopen(path, "re");
+	if (!file) err(1, "%s", path);
+	int n = fscanf(file, "%d", &boost.steady);
+	fclose(file);
+	if (n != 1) errx(1, "%s: invalid weight", path);
+}
+
+// Called in the child before exec.
+void boostJoin(void) {
+	if (!boost.set || cgroup.dir) return;
+	if (setpriority(PRIO_PROCESS, 0, boost.value)) warn("setpriority");
+}
+
+static int boostSet(int value) {
+	if (!cgroup.dir) return setpriority(PRIO_PGRP, cgroup.child, value);
+	char str[16];
+	snprintf(str, sizeof(str), "%d", value);
+	return cgroupWrite("cpu.weight", str);
+}
+
+void boostFork(const struct timeval *now) {
+	if (!boost.set) return;
+	if (cgroup.dir && boostSet(boost.value)) {
+		syslog(LOG_WARNING, "%s/cpu.weight: %m", cgroup.dir);
+	}
+	boost.active = true;
+	timeradd(now, &boost.timeout, &boost.until);
+}
+
+void boostEnd(const char *reason) {
+	if (!boost.active) return;
+	boost.active = false;
+	// The process group may outlive the child, or already be gone.
+	if (boostSet(boost.steady) && errno != ESRCH) {
+		syslog(LOG_WARNING, "boost: %m");
+	}
+	if (reason) syslog(LOG_INFO, "ending boost: %s", reason);
+}
+
+void boostPause(const struct timeval *paused) {
+	if (boost.active) timeradd(&boost.until, paused, &boost.until);
+}
+
+// The timeout stands still while the child is frozen.
+void boostPoll(const struct timeval *now, struct timeval *deadline) {
+	if (!boost.active || cgroup.frozen) return;
+	if (timercmp(now, &boost.until, >=)) {
+		boostEnd("timed out");
+	} else {
+		deadlineMin(deadline, &boost.until);
+	}
+}
@@ -0,0 +1,297 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "kitd.h"
+
+enum { RequestCap = 256, QueueCap = 16 * 1024 };
+
+static const char *PriorityNames[] = {
+	[LOG_EMERG] = "emerg",
+	[LOG_ALERT] = "alert",
+	[LOG_CRIT] = "crit",
+	[LOG_ERR] = "err",
+	[LOG_WARNING] = "warning",
+	[LOG_NOTICE] = "notice",
+	[LOG_INFO] = "info",
+	[LOG_DEBUG] = "debug",
+};
+
+struct Client {
+	int fd;
+	bool tail;
+	unsigned streams;
+	int priority;
+	size_t drops;
+	size_t len;
+	char buf[QueueCap];
+};
+
+size_t subscribers;
+
+static struct sockaddr_un addr = { .sun_family = AF_UNIX };
+static int server = -1;
+static struct Client clients[ClientCap];
+
+void controlInit(const char *path) {
+	// Keep an absolute path so the socket can be removed after daemon(3).
+	int len;
+	if (path[0] != '/') {
+		char cwd[sizeof(addr.sun_path)];
+		if (!getcwd(cwd, sizeof(cwd))) err(1, "getcwd");
+		len = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", cwd, path);
+	} else {
+		len = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	}
+	if ((size_t)len >= sizeof(addr.sun_path)) {
+		errx(1, "%s: %s", path, strerror(ENAMETOOLONG));
+	}
+
+	server = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (server < 0) err(1, "socket");
+	unlink(addr.sun_path);
+	int error = bind(server, (struct sockaddr *)&addr, SUN_LEN(&addr));
+	if (error) err(1, "%s", path);
+	error = listen(server, ClientCap);
+	if (error) err(1, "listen");
+
+	for (size_t i = 0; i < ClientCap; ++i) {
+		clients[i].fd = -1;
+	}
+}
+
+void controlClose(void) {
+	if (server < 0) return;
+	unlink(addr.sun_path);
+}
+
+static void clientClose(struct Client *client) {
+	if (client->tail) subscribers--;
+	close(client->fd);
+	client->fd = -1;
+}
+
+static void reply(struct Client *client, const char *msg) {
+	size_t len = strlen(msg);
+	if (client->len + len > sizeof(client->buf)) return;
+	memcpy(&client->buf[client->len], msg, len);
+	client->len += len;
+}
+
+static void tail(struct Client *client, char *args) {
+	client->streams = 0;
+	client->priority = LOG_DEBUG;
+	for (char *arg; NULL != (arg = strsep(&args, " "));) {
+		if (!*arg) continue;
+		bool found = false;
+		for (int i = 0; i < StreamCap; ++i) {
+			if (strcmp(arg, StreamNames[i])) continue;
+			client->streams |= 1 << i;
+			found = true;
+		}
+		for (int i = 0; i <= LOG_DEBUG; ++i) {
+			if (strcmp(arg, PriorityNames[i])) continue;
+			client->priority = i;
+			found = true;
+		}
+		if (!found) {
+			reply(client, "error: invalid filter\n");
+			return;
+		}
+	}
+	if (!client->streams) client->streams = ~0U;
+	client->tail = true;
+	subscribers++;
+}
+
+static void stats(struct Client *client) {
+	const char *info;
+	for (size_t i = 0; NULL != (info = sinkInfo(i)); ++i) {
+		reply(client, info);
+		reply(client, "\n");
+	}
+	for (size_t i = 0; NULL != (info = jobInfo(i)); ++i) {
+		reply(client, info);
+		reply(client, "\n");
+	}
+	for (size_t i = 0; NULL != (info = oomInfo(i)); ++i) {
+		reply(client, info);
+		reply(client, "\n");
+	}
+	for (size_t i = 0; NULL != (info = traceInfo(i)); ++i) {
+		reply(client, info);
+		reply(client, "\n");
+	}
+	if (!client->len) reply(client, "error: no stats\n");
+}
+
+static void trace(struct Client *client) {
+	if (!tracing) {
+		reply(client, "error: not tracing\n");
+	} else if (traceDump()) {
+		reply(client, "error: trace not written\n");
+	} else {
+		reply(client, "ok\n");
+	}
+}
+
+static void result(struct Client *client, const char *error) {
+	if (!error) {
+		reply(client, "ok\n");
+		return;
+	}
+	reply(client, "error: ");
+	reply(client, error);
+	reply(client, "\n");
+}
+
+static void request(struct Client *client, char *line) {
+	char *cmd = strsep(&line, " ");
+	if (!strcmp(cmd, "tail")) {
+		tail(client, line);
+	} else if (!strcmp(cmd, "stats")) {
+		stats(client);
+	} else if (!strcmp(cmd, "trace")) {
+		trace(client);
+	} else if (!strcmp(cmd, "freeze")) {
+		result(client, freeze());
+	} else if (!strcmp(cmd, "thaw")) {
+		result(client, thaw());
+	} else if (!strcmp(cmd, "restart")) {
+		result(client, rollRestart(line ? strtoul(line, NULL, 10) : 1));
+	} else {
+		reply(client, "error: unknown command\n");
+	}
+}
+
+static void clientRead(struct Client *client) {
+	char buf[RequestCap];
+	ssize_t len = read(client->fd, buf, sizeof(buf)-1);
+	if (len < 0 && errno == EAGAIN) return;
+	if (len <= 0 || client->tail) {
+		// Subscribers have nothing more to say; anything else is EOF.
+		if (len <= 0) clientClose(client);
+		return;
+	}
+	buf[len] = '\0';
+	char *nl = strchr(buf, '\n');
+	if (!nl) {
+		clientClose(client);
+		return;
+	}
+	*nl = '\0';
+	if (nl > buf && nl[-1] == '\r') nl[-1] = '\0';
+	request(client, buf);
+}
+
+static void clientWrite(struct Client *client) {
+	ssize_t len = send(client->fd, client->buf, client->len, MSG_NOSIGNAL);
+	if (len < 0 && errno == EAGAIN) return;
+	if (len < 0) {
+		clientClose(client);
+		return;
+	}
+	client->len -= len;
+	memmove(client->buf, &client->buf[len], client->len);
+	if (!client->tail && !client->len) clientClose(client);
+	if (client->tail && client->drops) {
+		char drops[32];
+		snprintf(drops, sizeof(drops), "dropped %zu\n", client->drops);
+		size_t dropsLen = strlen(drops);
+		if (client->len + dropsLen > sizeof(client->buf)) return;
+		memcpy(&client->buf[client->len], drops, dropsLen);
+		client->len += dropsLen;
+		client->drops = 0;
+	}
+}
+
+static void controlAccept(void) {
+	int fd = accept4(server, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		if (errno != EAGAIN) syslog(LOG_WARNING, "accept: %m");
+		return;
+	}
+	for (size_t i = 0; i < ClientCap; ++i) {
+		if (clients[i].fd >= 0) continue;
+		clients[i] = (struct Client) { .fd = fd };
+		return;
+	}
+	close(fd);
+}
+
+void controlPoll(struct pollfd fds[static 1 + ClientCap]) {
+	fds[0].fd = server;
+	fds[0].events = POLLIN;
+	for (size_t i = 0; i < ClientCap; ++i) {
+		fds[1 + i].fd = clients[i].fd;
+		fds[1 + i].events = POLLIN;
+		if (clients[i].len) fds[1 + i].events |= POLLOUT;
+	}
+}
+
+void controlEvent(const struct pollfd fds[static 1 + ClientCap]) {
+	for (size_t i = 0; i < ClientCap; ++i) {
+		struct Client *client = &clients[i];
+		if (client->fd < 0 || client->fd != fds[1 + i].fd) continue;
+		short revents = fds[1 + i].revents;
+		if (revents & (POLLIN | POLLHUP | POLLERR)) clientRead(client);
+		if (client->fd >= 0 && client->len) clientWrite(client);
+	}
+	if (fds[0].revents) controlAccept();
+}
+
+void controlRecord(enum Stream stream, int priority, const char *msg) {
+	const char *name = StreamNames[stream];
+	size_t nameLen = strlen(name);
+	size_t len = strlen(msg);
+	for (size_t i = 0; i < ClientCap; ++i) {
+		struct Client *client = &clients[i];
+		if (client->fd < 0 || !client->tail) continue;
+		if (!(client->streams & (1 << stream))) continue;
+		if (priority > client->priority) continue;
+
+		char drops[32] = "";
+		if (client->drops) {
+			snprintf(drops, sizeof(drops), "dropped %zu\n", client->drops);
+		}
+		size_t dropsLen = strlen(drops);
+		if (
+			client->len + dropsLen + nameLen + 1 + len + 1 > sizeof(client->buf)
+		) {
+			client->drops++;
+			continue;
+		}
+		char *ptr = &client->buf[client->len];
+		memcpy(ptr, drops, dropsLen);
+		ptr += dropsLen;
+		memcpy(ptr, name, nameLen);
+		ptr[nameLen] = ' ';
+		memcpy(&ptr[nameLen + 1], msg, len);
+		ptr[nameLen + 1 + len] = '\n';
+		client->len += dropsLen + nameLen + 1 + len + 1;
+		client->drops = 0;
+	}
+}
@@ -0,0 +1,279 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "kitd.h"
+
+static struct {
+	const char *dir;
+	const char *name;
+	const char *command;
+	size_t keep;
+	time_t started;
+	pid_t worker;
+	bool pending;
+} core;
+
+void coreInit(
+	const char *dir, const char *name, const char *command, size_t keep
+) {
+	struct stat st;
+	if (stat(dir, &st)) err(1, "%s", dir);
+	if (!S_ISDIR(st.st_mode)) errx(1, "%s: not a directory", dir);
+	core.dir = dir;
+	core.name = name;
+	core.command = strrchr(command, '/');
+	core.command = (core.command ? &core.command[1] : command);
+	core.keep = keep;
+}
+
+// Cores older than the child are not its own.
+void coreFork(void) {
+	core.started = time(NULL);
+}
+
+// Called in the child before exec.
+void coreLimit(void) {
+	struct rlimit limit = { RLIM_INFINITY, RLIM_INFINITY };
+	if (setrlimit(RLIMIT_CORE, &limit)) {
+		getrlimit(RLIMIT_CORE, &limit);
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_CORE, &limit);
+	}
+}
+
+// Cores of pid as named by default on Linux and the BSDs: core, core.pid,
+// or the command name with .core. The BSDs cut the name short at 19 or 23
+// characters, Linux at 15.
+static bool isCore(const char *name, pid_t pid) {
+	if (name[0] == '.') return false;
+	char buf[32];
+	snprintf(buf, sizeof(buf), "core.%d", (int)pid);
+	if (!strcmp(name, "core") || !strcmp(name, buf)) return true;
+	size_t len = strlen(name);
+	if (len <= 5 || strcmp(&name[len-5], ".core")) return false;
+	len -= 5;
+	return !strncmp(name, core.command, len)
+		&& (!core.command[len] || len >= 15);
+}
+
+static bool isSaved(const char *name) {
+	size_t len = strlen(core.name);
+	size_t nameLen = strlen(name);
+	return !strncmp(name, core.name, len) && name[len] == '.'
+		&& nameLen > 3 && !strcmp(&name[nameLen-3], ".gz");
+}
+
+// A core claimed for the worker is its saved name, hidden and not yet
+// compressed.
+static bool isClaimed(const char *name) {
+	size_t len = strlen(core.name);
+	size_t nameLen = strlen(name);
+	return name[0] == '.' && !strncmp(&name[1], core.name, len)
+		&& name[1 + len] == '.'
+		&& !(nameLen > 3 && !strcmp(&name[nameLen-3], ".gz"));
+}
+
+static int compare(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void compress(int dir, int saveDir, const char *name) {
+	char saved[NAME_MAX + 1];
+	int len = snprintf(saved, sizeof(saved), "%s.gz", &name[1]);
+	if ((size_t)len >= sizeof(saved)) return;
+	int in = openat(dir, name, O_RDONLY | O_CLOEXEC);
+	if (in < 0) {
+		syslog(LOG_WARNING, "%s: %m", &name[1]);
+		return;
+	}
+	int out = openat(
+		saveDir, saved, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600
+	);
+	if (out < 0) {
+		syslog(LOG_WARNING, "%s/%s: %m", core.dir, saved);
+		close(in);
+		return;
+	}
+	pid_t pid = fork();
+	if (pid < 0) {
+		syslog(LOG_WARNING, "fork: %m");
+	} else if (!pid) {
+		sigset_t unmask;
+		sigemptyset(&unmask);
+		sigprocmask(SIG_SETMASK, &unmask, NULL);
+		dup2(in, STDIN_FILENO);
+		dup2(out, STDOUT_FILENO);
+		execlp("gzip", "gzip", "-c", NULL);
+		syslog(LOG_WARNING, "gzip: %m");
+		_exit(127);
+	}
+	close(in);
+	close(out);
+	int status = 1;
+	if (pid > 0) waitpid(pid, &status, 0);
+	if (WIFEXITED(status) && !WEXITSTATUS(status)) {
+		unlinkat(dir, name, 0);
+		syslog(LOG_NOTICE, "saved core to %s/%s", core.dir, saved);
+	} else {
+		unlinkat(saveDir, saved, 0);
+		syslog(LOG_WARNING, "%s: not compressed", &name[1]);
+	}
+}
+
+// Remove all but the newest saved cores. Their names sort by time.
+static void rotate(void) {
+	DIR *d = opendir(core.dir);
+	if (!d) return;
+	int dir = dirfd(d);
+	size_t len = 0, cap = 0;
+	char **names = NULL;
+	for (struct dirent *ent; NULL != (ent = readdir(d));) {
+		if (!isSaved(ent->d_name)) continue;
+		if (len == cap) {
+			cap = (cap ? 2 * cap : 16);
+			char **ptr = realloc(names, cap * sizeof(*names));
+			if (!ptr) break;
+			names = ptr;
+		}
+		names[len] = strdup(ent->d_name);
+		if (names[len]) len++;
+	}
+	qsort(names, len, sizeof(*names), compare);
+	for (size_t i = 0; i + core.keep < len; ++i) {
+		unlinkat(dir, names[i], 0);
+	}
+	closedir(d);
+	for (size_t i = 0; i < len; ++i) {
+		free(names[i]);
+	}
+	free(names);
+}
+
+// Cores are written to the working directory of the child, which is that
+// of kitd, or wherever the system's core file pattern points.
+static const char *coreDirs(size_t i) {
+	return (i == 0 ? "." : i == 1 ? core.dir : NULL);
+}
+
+// Compress every claimed core, out of the way of the child and of kitd
+// itself.
+static void coreWork(void) {
+	// Let go of the sockets and pipes of kitd, so that gzip(1) holds
+	// none of them open either.
+	closelog();
+	closefrom(STDERR_FILENO + 1);
+	openlog(core.name, LOG_NDELAY | LOG_PERROR, LOG_DAEMON);
+	setpriority(PRIO_PROCESS, 0, 19);
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	// IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE.
+	syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+#endif
+	int saveDir = open(core.dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (saveDir < 0) {
+		syslog(LOG_WARNING, "%s: %m", core.dir);
+		_exit(1);
+	}
+	const char *path;
+	for (size_t i = 0; NULL != (path = coreDirs(i)); ++i) {
+		DIR *d = opendir(path);
+		if (!d) {
+			syslog(LOG_WARNING, "%s: %m", path);
+			continue;
+		}
+		int dir = dirfd(d);
+		for (struct dirent *ent; NULL != (ent = readdir(d));) {
+			if (isClaimed(ent->d_name)) compress(dir, saveDir, ent->d_name);
+		}
+		closedir(d);
+	}
+	rotate();
+	_exit(0);
+}
+
+static void coreStart(void) {
+	core.pending = false;
+	core.worker = fork();
+	if (core.worker < 0) {
+		syslog(LOG_WARNING, "fork: %m");
+		core.worker = 0;
+	} else if (!core.worker) {
+		coreWork();
+	}
+}
+
+// The core is complete once the exit is seen, but a restarted child could
+// write another of the same name while the worker is busy with it. Claim
+// it first under the name it will be saved as. Only cores of pid written
+// since it started are claimed, leaving any others in the same directory.
+void coreSave(pid_t pid) {
+	const char *path;
+	for (size_t i = 0; NULL != (path = coreDirs(i)); ++i) {
+		DIR *d = opendir(path);
+		if (!d) continue;
+		int dir = dirfd(d);
+		for (struct dirent *ent; NULL != (ent = readdir(d));) {
+			if (!isCore(ent->d_name, pid)) continue;
+			struct stat st;
+			if (fstatat(dir, ent->d_name, &st, 0) || !S_ISREG(st.st_mode)) {
+				continue;
+			}
+			if (st.st_uid != geteuid() || st.st_mtime < core.started) continue;
+			char claimed[NAME_MAX + 1];
+			int len = snprintf(
+				claimed, sizeof(claimed), ".%s.%lld.%09ld.%s", core.name,
+				(long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, ent->d_name
+			);
+			if ((size_t)len >= sizeof(claimed)) continue;
+			if (renameat(dir, ent->d_name, dir, claimed)) {
+				syslog(LOG_WARNING, "%s/%s: %m", path, ent->d_name);
+			}
+		}
+		closedir(d);
+	}
+	if (core.worker) {
+		core.pending = true;
+	} else {
+		coreStart();
+	}
+}
+
+// Whether pid was the worker, starting it again for cores that came in
+// while it was busy.
+bool coreReap(pid_t pid) {
+	if (!pid || pid != core.worker) return false;
+	core.worker = 0;
+	if (core.pending) coreStart();
+	return true;
+}
@@ -0,0 +1,125 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kitd.h"
+
+enum { QueueCap = 64 * 1024 };
+
+static const struct timeval Retry = { .tv_sec = 1 };
+
+static struct Sink sink;
+
+static struct {
+	const char *path;
+	int fd;
+	struct timeval retry;
+	size_t drops;
+	size_t len;
+	char buf[QueueCap];
+} file = { .fd = -1 };
+
+static int fileOpen(void) {
+	return open(
+		file.path, O_WRONLY | O_APPEND | O_CREAT | O_NONBLOCK | O_CLOEXEC, 0644
+	);
+}
+
+void fileInit(const char *path) {
+	file.path = path;
+	file.fd = fileOpen();
+	if (file.fd < 0) err(1, "%s", path);
+	sink.name = path;
+	sink.up = true;
+	sinkAdd(&sink);
+}
+
+static void fileError(void) {
+	syslog(LOG_WARNING, "%s: %m", file.path);
+	close(file.fd);
+	file.fd = -1;
+	sink.up = false;
+	struct timeval time;
+	monotonic(&time);
+	timeradd(&time, &Retry, &file.retry);
+}
+
+void filePoll(struct pollfd *pfd, const struct timeval *now, struct timeval *deadline) {
+	if (file.fd < 0 && timercmp(now, &file.retry, >=)) {
+		file.fd = fileOpen();
+		if (file.fd < 0) {
+			timeradd(now, &Retry, &file.retry);
+		} else {
+			sink.up = true;
+		}
+	}
+	if (file.fd < 0) deadlineMin(deadline, &file.retry);
+	pfd->fd = (file.len ? file.fd : -1);
+	pfd->events = POLLOUT;
+}
+
+void fileEvent(short revents) {
+	if (revents) fileFlush();
+}
+
+void fileRecord(enum Stream stream, const char *msg) {
+	char buf[2048];
+	int len = snprintf(
+		buf, sizeof(buf), "%s %s %s\n", sinkStamp(), StreamNames[stream], msg
+	);
+	if ((size_t)len >= sizeof(buf)) {
+		len = sizeof(buf)-1;
+		buf[len-1] = '\n';
+	}
+	if (file.len + len > sizeof(file.buf)) fileFlush();
+	if (file.len + len > sizeof(file.buf)) {
+		file.drops++;
+		sink.drops++;
+		return;
+	}
+	memcpy(&file.buf[file.len], buf, len);
+	file.len += len;
+	sinkQueue(&sink);
+}
+
+void fileFlush(void) {
+	if (file.fd < 0 || !file.len) return;
+	ssize_t len = write(file.fd, file.buf, file.len);
+	if (len < 0 && errno == EAGAIN) return;
+	if (len < 0) {
+		fileError();
+		return;
+	}
+	file.len -= len;
+	memmove(file.buf, &file.buf[len], file.len);
+	sinkWrote(&sink, !file.len);
+	if (file.drops) {
+		syslog(LOG_WARNING, "%s: dropped %zu records", file.path, file.drops);
+		file.drops = 0;
+	}
+}
+
+bool fileBlocked(void) {
+	return sink.overflow == Block && file.fd >= 0 && file.len;
+}
@@ -0,0 +1,166 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "kitd.h"
+
+enum { RunCap = 256 };
+
+static struct {
+	struct timeval every;
+	int hour;
+	int minute;
+	struct timeval next;
+	struct timeval started;
+	size_t runs;
+	size_t failures;
+	size_t timeouts;
+	size_t skips;
+	int status;
+	unsigned long long samples[RunCap];
+} job = { .hour = -1, .minute = -1 };
+
+void jobEvery(const struct timeval *every) {
+	if (!timerisset(every)) errx(1, "invalid schedule 0");
+	job.every = *every;
+}
+
+// Either HH:MM daily or *:MM hourly.
+void jobCalendar(const char *str) {
+	int n;
+	if (str[0] == '*') {
+		n = sscanf(str, "*:%d", &job.minute);
+		n = (n == 1 ? 2 : 0);
+	} else {
+		n = sscanf(str, "%d:%d", &job.hour, &job.minute);
+	}
+	if (
+		n != 2 || job.hour < -1 || job.hour > 23 ||
+		job.minute < 0 || job.minute > 59
+	) {
+		errx(1, "invalid schedule %s", str);
+	}
+}
+
+static void calendarNext(const struct timeval *now) {
+	time_t t = time(NULL);
+	struct tm tm;
+	localtime_r(&t, &tm);
+	tm.tm_sec = 0;
+	tm.tm_min = job.minute;
+	if (job.hour >= 0) tm.tm_hour = job.hour;
+	// The wall clock may lag the monotonic one by a fraction of a second,
+	// so never schedule the same minute again right after it ran.
+	time_t next;
+	while ((next = mktime(&tm)) <= t + 1) {
+		if (job.hour >= 0) {
+			tm.tm_mday++;
+		} else {
+			tm.tm_hour++;
+		}
+		tm.tm_isdst = -1;
+	}
+	struct timeval delay = { .tv_sec = next - t };
+	timeradd(now, &delay, &job.next);
+}
+
+// Whether a run is due, advancing the schedule past now if so. Interval
+// schedules run at once, and runs missed in the meantime are not made up.
+bool jobDue(const struct timeval *now) {
+	if (!timerisset(&job.next)) {
+		if (timerisset(&job.every)) {
+			job.next = *now;
+		} else {
+			calendarNext(now);
+		}
+	}
+	if (timercmp(now, &job.next, <)) return false;
+	if (timerisset(&job.every)) {
+		while (!timercmp(now, &job.next, <)) {
+			timeradd(&job.next, &job.every, &job.next);
+		}
+	} else {
+		calendarNext(now);
+	}
+	return true;
+}
+
+// Push the schedule back by the time the run was frozen, so that it is not
+// skipped or killed for not running.
+void jobPause(const struct timeval *paused) {
+	if (timerisset(&job.next)) timeradd(&job.next, paused, &job.next);
+}
+
+const struct timeval *jobNext(void) {
+	return &job.next;
+}
+
+void jobStart(const struct timeval *now) {
+	job.started = *now;
+}
+
+void jobSkip(void) {
+	job.skips++;
+}
+
+void jobExit(const struct timeval *now, int status, bool timedOut) {
+	struct timeval ran;
+	timersub(now, &job.started, &ran);
+	unsigned long long usec = ran.tv_sec * 1000000ULL + ran.tv_usec;
+	job.samples[job.runs++ % RunCap] = usec;
+	job.status = status;
+	bool ok = runOk(status, timedOut);
+	if (timedOut) job.timeouts++;
+	if (!ok) job.failures++;
+	syslog(
+		(ok ? LOG_INFO : LOG_NOTICE), "run %s after %.3fs",
+		(ok ? "succeeded" : timedOut ? "timed out" : "failed"), usec / 1e6
+	);
+}
+
+const char *jobInfo(size_t i) {
+	static char buf[256];
+	if (!job.runs) return NULL;
+	if (i == 0) {
+		int status = job.status;
+		snprintf(
+			buf, sizeof(buf),
+			"runs: %zu times, %zu failed, %zu timed out, %zu skipped, "
+			"last %s %d",
+			job.runs, job.failures, job.timeouts, job.skips,
+			(WIFSIGNALED(status) ? "killed by signal" : "exited"),
+			(WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status))
+		);
+		return buf;
+	}
+	if (i > 1) return NULL;
+	unsigned long long samples[RunCap];
+	size_t len = (job.runs < RunCap ? job.runs : RunCap);
+	memcpy(samples, job.samples, len * sizeof(*samples));
+	struct Percentiles pct;
+	percentiles(&pct, samples, len);
+	snprintf(
+		buf, sizeof(buf), "duration: p50 %.3fs, p90 %.3fs, max %.3fs",
+		pct.p50 / 1e6, pct.p90 / 1e6, pct.max / 1e6
+	);
+	return buf;
+}
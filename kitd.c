@@ -18,53 +18,323 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <sys/wait.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
-struct LineBuffer {
+#include "kitd.h"
+
+static const char *remote;
+static const char *raw;
+static const char *file;
+static bool logSyslog;
+static bool init;
+static bool counters;
+static int notify = -1;
+static size_t bench;
+static pid_t child;
+
+static struct Sink syslogSink = { .name = "syslog", .up = true };
+
+enum { SampleMax = 1 << 16 };
+
+// Under load, log only one in n lines below LOG_NOTICE.
+static struct {
+	size_t rate;
+	size_t n;
+	size_t seen;
+	size_t skips;
+	bool pressure;
+	unsigned long long drops;
+	struct timeval start;
+} sample = { .n = 1 };
+
+// Pick n for the next second from the rate of the last, doubling it while
+// the sinks are falling behind and halving it for each second since they
+// caught up. The loop may sleep through many seconds while the child is
+// idle, so below the rate sampling stops at once.
+void sampleUpdate(const struct timeval *now) {
+	if (!sample.rate) return;
+	struct timeval elapsed;
+	timersub(now, &sample.start, &elapsed);
+	if (elapsed.tv_sec < 1) return;
+	double secs = elapsed.tv_sec + elapsed.tv_usec / 1e6;
+	size_t perSec = sample.seen / secs;
+	size_t n = (perSec + sample.rate - 1) / sample.rate;
+	unsigned long long drops = sinkDrops();
+	if (sample.pressure || drops > sample.drops) {
+		if (n < 2 * sample.n) n = 2 * sample.n;
+	} else if (perSec < sample.rate) {
+		n = 1;
+	} else {
+		size_t halved = (elapsed.tv_sec < 16 ? sample.n >> elapsed.tv_sec : 0);
+		if (n < halved) n = halved;
+	}
+	if (n < 1) n = 1;
+	if (n > SampleMax) n = SampleMax;
+
+	if (n > 1 && sample.n == 1) {
+		syslog(LOG_NOTICE, "sampling 1 in %zu lines of standard output", n);
+	} else if (n == 1 && sample.n > 1) {
+		syslog(LOG_NOTICE, "stopped sampling after skipping %zu lines", sample.skips);
+		sample.skips = 0;
+	}
+	sample.n = n;
+	sample.seen = 0;
+	sample.pressure = false;
+	sample.drops = drops;
+	sample.start = *now;
+}
+
+// Within the second, double n each time the lines seen pass n times the
+// rate, so that a burst is sampled from its start rather than only once
+// sampleUpdate() has seen a whole second of it.
+static void sampleLine(void) {
+	if (sample.seen < sample.rate * sample.n || sample.n >= SampleMax) return;
+	if (sample.n == 1) {
+		syslog(LOG_NOTICE, "sampling 1 in 2 lines of standard output");
+	}
+	sample.n *= 2;
+}
+
+// Wake each second while sampling, so that n falls as soon as output does.
+static void samplePoll(struct timeval *deadline) {
+	if (sample.n < 2) return;
+	struct timeval next, second = { .tv_sec = 1 };
+	timeradd(&sample.start, &second, &next);
+	deadlineMin(deadline, &next);
+}
+
+static void record(enum Stream stream, int priority, pid_t pid, const char *msg) {
+	PROBE3(record, stream, priority, msg);
+	char buf[2048];
+	if (sample.rate && priority > LOG_NOTICE) {
+		sampleLine();
+		if (sample.seen++ % sample.n) {
+			sample.skips++;
+			return;
+		}
+		// Tag the lines kept so that counts can be scaled back up.
+		if (sample.n > 1) {
+			snprintf(buf, sizeof(buf), "[1/%zu] %s", sample.n, msg);
+			msg = buf;
+		}
+	}
+	if (subscribers) controlRecord(stream, priority, msg);
+	if (file) fileRecord(stream, msg);
+	if (remote) remoteRecord(priority, pid, msg);
+	if (logSyslog) {
+		unsigned long long start = traceBegin();
+		sinkQueue(&syslogSink);
+		syslog(priority, "%s", msg);
+		sinkWrote(&syslogSink, true);
+		traceEnd(PhaseSyslog, start);
+	}
+}
+
+static void flush(void) {
+	if (remote) remoteFlush();
+	if (file) fileFlush();
+}
+
+static bool blocked(void) {
+	return (remote && remoteBlocked()) || (file && fileBlocked());
+}
+
+// Wait on the remote and the file in fds, returning whether there is room
+// for more output.
+bool outputPoll(
+	struct pollfd fds[static 2], const struct timeval *now,
+	struct timeval *deadline
+) {
+	if (remote) remotePoll(&fds[0], now, deadline);
+	if (file) filePoll(&fds[1], now, deadline);
+	samplePoll(deadline);
+	if (!blocked()) return true;
+	sample.pressure = true;
+	return false;
+}
+
+void outputEvent(const struct pollfd fds[static 2], int nfds) {
+	if (remote) {
+		if (nfds > 0) remoteEvent(fds[0].revents);
+		remoteFlush();
+	}
+	if (file) {
+		if (nfds > 0) fileEvent(fds[1].revents);
+		fileFlush();
+	}
+}
+
+// Wait for what is queued to be written before exiting.
+void outputDrain(void) {
+	if (file) fileFlush();
+	if (remote) remoteDrain();
+}
+
+// Report on the output and where it goes, after whatever the mode reports.
+void outputInfo(void) {
+	if (raw) rawInfo();
+	if (sample.n > 1) {
+		syslog(
+			LOG_INFO, "sampling 1 in %zu lines of standard output, "
+			"skipped %zu", sample.n, sample.skips
+		);
+	}
+	const char *info;
+	for (size_t i = 0; NULL != (info = sinkInfo(i)); ++i) {
+		syslog(LOG_INFO, "%s", info);
+	}
+	for (size_t i = 0; NULL != (info = traceInfo(i)); ++i) {
+		syslog(LOG_INFO, "%s", info);
+	}
+}
+
+// The most recent output of the child, regardless of where it is logged.
+static struct {
+	size_t cap;
 	size_t len;
-	char buf[1024];
-};
+	size_t head;
+	char *buf;
+} recorder;
+
+void recorderWrite(const char *ptr, size_t len) {
+	if (!recorder.cap) return;
+	if (len > recorder.cap) {
+		ptr += len - recorder.cap;
+		len = recorder.cap;
+	}
+	size_t tail = recorder.cap - recorder.head;
+	if (len < tail) tail = len;
+	memcpy(&recorder.buf[recorder.head], ptr, tail);
+	memcpy(recorder.buf, &ptr[tail], len - tail);
+	recorder.head = (recorder.head + len) % recorder.cap;
+	recorder.len += len;
+	if (recorder.len > recorder.cap) recorder.len = recorder.cap;
+}
 
-static void lbFill(struct LineBuffer *lb, int fd) {
+static void recorderDump(void) {
+	if (!recorder.len) return;
+	char *buf = malloc(recorder.len + 1);
+	if (!buf) {
+		syslog(LOG_ERR, "malloc: %m");
+		return;
+	}
+	size_t start = (recorder.head + recorder.cap - recorder.len) % recorder.cap;
+	size_t tail = recorder.cap - start;
+	if (recorder.len < tail) tail = recorder.len;
+	memcpy(buf, &recorder.buf[start], tail);
+	memcpy(&buf[tail], recorder.buf, recorder.len - tail);
+	buf[recorder.len] = '\0';
+
+	// Skip the partial first line once the ring has wrapped.
+	char *ptr = buf;
+	if (recorder.len == recorder.cap) {
+		char *nl = strchr(ptr, '\n');
+		if (nl) ptr = &nl[1];
+	}
+	syslog(LOG_NOTICE, "last output:");
+	for (char *line; NULL != (line = strsep(&ptr, "\n"));) {
+		if (!ptr && !*line) break;
+		syslog(LOG_NOTICE, "> %s", line);
+	}
+	free(buf);
+}
+
+// Longest line logged as one record; longer lines are logged in pieces.
+enum { LineMax = 1023 };
+
+static bool lbFill(struct LineBuffer *lb, int fd) {
 	size_t cap = sizeof(lb->buf)-1 - lb->len;
+	unsigned long long start = traceBegin();
 	ssize_t len = read(fd, &lb->buf[lb->len], cap);
+	traceEnd(PhaseFill, start);
+	PROBE2(read, fd, len);
 	if (len < 0 && errno != EAGAIN) {
 		syslog(LOG_ERR, "read: %m");
 	}
+	if (len > 0) recorderWrite(&lb->buf[lb->len], len);
 	if (len > 0) lb->len += len;
+	return len > 0 && (size_t)len == cap;
 }
 
-static void lbFlush(struct LineBuffer *lb, int priority) {
-	assert(lb->len < sizeof(lb->buf));
-	lb->buf[lb->len] = '\0';
-
-	if (lb->len == sizeof(lb->buf)-1) {
-		syslog(priority, "%s", lb->buf);
-		lb->len = 0;
+static void lbRecord(
+	const struct LineBuffer *lb, enum Stream stream, int priority,
+	const char *msg
+) {
+	if (!lb->tag) {
+		record(stream, priority, lb->pid, msg);
 		return;
 	}
+	char buf[2048];
+	snprintf(buf, sizeof(buf), "%s: %s", lb->tag, msg);
+	record(stream, priority, lb->pid, buf);
+}
+
+void lbFlush(struct LineBuffer *lb, enum Stream stream, int priority) {
+	assert(lb->len < sizeof(lb->buf));
+	lb->buf[lb->len] = '\0';
+	unsigned long long start = traceBegin();
 
 	char *ptr = lb->buf;
-	for (char *nl; NULL != (nl = strchr(ptr, '\n')); ptr = &nl[1]) {
-		*nl = '\0';
-		syslog(priority, "%s", ptr);
+	char *end = &lb->buf[lb->len];
+	for (;;) {
+		size_t len = end - ptr;
+		char *nl = memchr(ptr, '\n', (len > LineMax ? LineMax + 1 : len));
+		if (nl) {
+			*nl = '\0';
+			lbRecord(lb, stream, priority, ptr);
+			ptr = &nl[1];
+		} else if (len > LineMax) {
+			char c = ptr[LineMax];
+			ptr[LineMax] = '\0';
+			lbRecord(lb, stream, priority, ptr);
+			ptr[LineMax] = c;
+			ptr += LineMax;
+		} else {
+			break;
+		}
 	}
 	lb->len -= ptr - lb->buf;
 	memmove(lb->buf, ptr, lb->len);
+	traceEnd(PhaseFlush, start);
+}
+
+// Read until the pipe is drained, up to a few buffers per wakeup so that
+// one busy stream cannot starve the rest of the loop. Stop early if a sink
+// cannot keep up, leaving the rest in the pipe.
+void lbDrain(struct LineBuffer *lb, int fd, enum Stream stream, int priority) {
+	for (int i = 0; i < 4; ++i) {
+		bool full = lbFill(lb, fd);
+		lbFlush(lb, stream, priority);
+		flush();
+		if (!full || blocked()) break;
+	}
+}
+
+// Read what is left in the pipe before exiting, waiting for the remote.
+void lbFinish(struct LineBuffer *lb, int fd, enum Stream stream, int priority) {
+	bool full = true;
+	for (int i = 0; full && i < 64; ++i) {
+		full = lbFill(lb, fd);
+		lbFlush(lb, stream, priority);
+		outputDrain();
+	}
 }
 
 enum { M = 60, H = 60*M, D = 24*H };
 
-static const char *humanize(const struct timeval *interval) {
+const char *humanize(const struct timeval *interval) {
 	static char buf[256];
 	if (!interval->tv_sec) {
 		snprintf(buf, sizeof(buf), "%dms", (int)(interval->tv_usec / 1000));
@@ -81,18 +351,165 @@ static const char *humanize(const struct timeval *interval) {
 	return buf;
 }
 
-static void parse(struct timeval *interval, const char *str) {
+// Resolve a relative path before daemon(3) changes directory.
+static const char *absolute(const char *path) {
+	if (path[0] == '/') return path;
+	char cwd[PATH_MAX];
+	if (!getcwd(cwd, sizeof(cwd))) err(1, "getcwd");
+	char *abs;
+	if (asprintf(&abs, "%s/%s", cwd, path) < 0) err(1, "asprintf");
+	return abs;
+}
+
+static size_t parseSize(const char *str) {
 	char *endptr;
-	unsigned long n = strtoul(str, &endptr, 10);
-	timerclear(interval);
+	size_t n = strtoull(str, &endptr, 10);
 	switch (*endptr) {
-		break; case 's': interval->tv_sec = n;
-		break; case 'm': interval->tv_sec = n*M;
-		break; case 'h': interval->tv_sec = n*H;
-		break; case 'd': interval->tv_sec = n*D;
-		break; case '\0': interval->tv_usec = n * 1000;
+		break; case 'k': n <<= 10;
+		break; case 'm': n <<= 20;
+		break; case 'g': n <<= 30;
+		break; case '\0':
 		break; default: errx(1, "invalid suffix '%c'", *endptr);
 	}
+	return n;
+}
+
+static void parse(struct timeval *interval, const char *str) {
+	const char *end = parseInterval(interval, str);
+	if (*end) errx(1, "invalid suffix '%c'", *end);
+}
+
+// A daily window of local time, in minutes since midnight.
+static struct {
+	bool set;
+	int start;
+	int end;
+} window;
+
+static void parseWindow(const char *str) {
+	int h1, m1, h2, m2;
+	int n = sscanf(str, "%d:%d-%d:%d", &h1, &m1, &h2, &m2);
+	if (
+		n != 4 || h1 < 0 || h1 > 23 || m1 < 0 || m1 > 59 ||
+		h2 < 0 || h2 > 23 || m2 < 0 || m2 > 59
+	) {
+		errx(1, "invalid window %s", str);
+	}
+	window.set = true;
+	window.start = h1 * 60 + m1;
+	window.end = h2 * 60 + m2;
+	if (window.start == window.end) errx(1, "invalid window %s", str);
+}
+
+static time_t windowLength(void) {
+	return (window.end - window.start + 24*60) % (24*60) * 60;
+}
+
+// Seconds until the window opens, or 0 while it is open. A window may wrap
+// past midnight.
+static time_t windowWait(void) {
+	time_t t = time(NULL);
+	struct tm tm;
+	localtime_r(&t, &tm);
+	int m = tm.tm_hour * 60 + tm.tm_min;
+	bool open = (
+		window.start < window.end
+		? m >= window.start && m < window.end
+		: m >= window.start || m < window.end
+	);
+	if (open) return 0;
+	return (window.start - m + 24*60) % (24*60) * 60 - tm.tm_sec;
+}
+
+// A random delay of up to max. Past 49 days, milliseconds need 64 bits.
+static struct timeval spread(const struct timeval *max) {
+	unsigned long long ms = max->tv_sec * 1000ULL + max->tv_usec / 1000;
+	unsigned long long r = (unsigned long long)arc4random() << 32
+		| arc4random();
+	ms = r % (ms + 1);
+	return (struct timeval) { .tv_sec = ms / 1000, .tv_usec = ms % 1000 * 1000 };
+}
+
+static void parseSchedule(const char *str) {
+	if (strchr(str, ':')) {
+		jobCalendar(str);
+		return;
+	}
+	struct timeval every;
+	parse(&every, str);
+	jobEvery(&every);
+}
+
+static enum Overlap parseOverlap(const char *str) {
+	if (!strcmp(str, "skip")) return Skip;
+	if (!strcmp(str, "queue")) return Queue;
+	if (!strcmp(str, "kill")) return Kill;
+	errx(1, "invalid overlap %s", str);
+}
+
+enum {
+	FdStdout,
+	FdStderr,
+	FdRemote,
+	FdFile,
+	FdRaw,
+	FdExec,
+	FdNotify,
+	FdWatch,
+	FdControl,
+	FdCap = FdControl + 1 + ClientCap,
+};
+
+const struct timeval Drain = { .tv_sec = 10 };
+
+static void forward(int sig) {
+	// A frozen child could not act on the signal to stop.
+	if (frozen() && (sig == SIGINT || sig == SIGTERM || sig == SIGKILL)) {
+		thaw();
+	}
+	PROBE2(signal, child, sig);
+	killpg(child, sig);
+}
+
+// Signals kitd acts on itself rather than forwarding.
+static bool forwarded(int sig) {
+	switch (sig) {
+		case SIGALRM: case SIGCHLD: case SIGINFO: case SIGINT: case SIGTERM:
+			return false;
+		default:
+			return true;
+	}
+}
+
+// Reap every exited process, returning whether the child was among them.
+// As process 1, orphans of the child's descendants are reaped here too.
+static bool reap(int *status, struct rusage *usage) {
+	bool found = false;
+	for (;;) {
+		int s;
+		struct rusage u;
+		pid_t pid = wait4(-1, &s, WNOHANG, &u);
+		if (pid < 0 && errno == EINTR) continue;
+		if (pid < 0 && errno != ECHILD) syslog(LOG_ERR, "wait: %m");
+		if (pid <= 0) break;
+		if (pid == child) {
+			*status = s;
+			*usage = u;
+			found = true;
+		} else if (!coreReap(pid) && !init) {
+			syslog(LOG_NOTICE, "unknown child %d", pid);
+		}
+	}
+	return found;
+}
+
+// In benchmark mode, stop each incarnation once it has started.
+static void started(enum Start start, const struct timeval *now) {
+	if (!startupMark(start, now)) return;
+	if (start == StartReady) boostEnd("ready");
+	if (bench && start == (notify >= 0 ? StartReady : StartOutput)) {
+		forward(SIGTERM);
+	}
 }
 
 static volatile sig_atomic_t signals[NSIG];
@@ -100,34 +517,187 @@ static void signalHandler(int signal) {
 	signals[signal] = 1;
 }
 
+// Take a pending signal to forward, or SIGINT or SIGTERM to stop on.
+int signalTake(void) {
+	for (int sig = 1; sig < NSIG; ++sig) {
+		if (!signals[sig]) continue;
+		if (!forwarded(sig) && sig != SIGINT && sig != SIGTERM) continue;
+		signals[sig] = 0;
+		return sig;
+	}
+	return 0;
+}
+
+// Clear a signal, returning whether it was pending.
+bool caught(int sig) {
+	if (!signals[sig]) return false;
+	signals[sig] = 0;
+	return true;
+}
+
+static void parseRange(size_t *min, size_t *max, const char *str) {
+	char *end;
+	*min = strtoul(str, &end, 10);
+	*max = (*end == '-' ? strtoul(&end[1], &end, 10) : *min);
+	if (*end || *min > *max) errx(1, "invalid range %s", str);
+}
+
 int main(int argc, char *argv[]) {
 	int error;
 
 	bool daemonize = true;
+	bool syslogOption = false;
+	bool once = false;
 	const char *name = NULL;
+	const char *control = NULL;
+	const char *trace = NULL;
 	struct timeval restart = { .tv_sec = 1 };
 	struct timeval cooloff = { .tv_sec = 15*M };
 	struct timeval maximum = { .tv_sec = 1*H };
-	for (int opt; 0 < (opt = getopt(argc, argv, "c:dm:n:t:"));) {
+	struct timeval lifetime = {0};
+	struct timeval jitter = {0};
+	bool job = false;
+	enum Overlap overlap = Skip;
+	struct timeval timeout = {0};
+	const char *items = NULL;
+	const char *cgroup = NULL;
+	const char *score = NULL;
+	size_t memory = 0;
+	const char *boost = NULL;
+	struct timeval boostTimeout = { .tv_sec = 30 };
+	const char *cores = NULL;
+	size_t keep = 3;
+	size_t parallel = 0;
+	unsigned attempts = 3;
+	size_t scaleMin = 0, scaleMax = 0;
+	size_t scaleLow = 30, scaleHigh = 80;
+	struct timeval rollUptime = { .tv_sec = 5 };
+	bool watchExecutable = false;
+	bool watching = false;
+	for (int opt; 0 < (opt = getopt(argc, argv, "A:B:CD:E:G:J:K:L:M:N:O:P:R:S:T:U:W:Y:b:c:def:g:i:j:k:lm:n:op:r:s:t:u:w:"));) {
 		switch (opt) {
+			break; case 'A': attempts = strtoul(optarg, NULL, 10);
+			break; case 'B': bench = strtoul(optarg, NULL, 10);
+			break; case 'C': counters = true;
+			break; case 'D': cores = absolute(optarg);
+			break; case 'E': boost = optarg;
+			break; case 'G': parse(&boostTimeout, optarg);
+			break; case 'J': parse(&jitter, optarg);
+			break; case 'K': keep = strtoul(optarg, NULL, 10);
+			break; case 'L': parse(&lifetime, optarg);
+			break; case 'M': memory = parseSize(optarg);
+			break; case 'N': notify = strtol(optarg, NULL, 10);
+			break; case 'O': overlap = parseOverlap(optarg);
+			break; case 'P': parallel = strtoul(optarg, NULL, 10);
+			break; case 'R': sample.rate = strtoul(optarg, NULL, 10);
+			break; case 'S': score = optarg;
+			break; case 'T': trace = absolute(optarg);
+			break; case 'U': parseRange(&scaleMin, &scaleMax, optarg);
+			break; case 'W': parseWindow(optarg);
+			break; case 'Y': parseRange(&scaleLow, &scaleHigh, optarg);
+			break; case 'b': recorder.cap = parseSize(optarg);
 			break; case 'c': parse(&cooloff, optarg);
 			break; case 'd': daemonize = false;
+			break; case 'e': watchExecutable = watching = true;
+			break; case 'f': file = absolute(optarg);
+			break; case 'g': cgroup = optarg;
+			break; case 'i': items = optarg;
+			break; case 'j': job = true; parseSchedule(optarg);
+			break; case 'k': parse(&timeout, optarg);
+			break; case 'l': syslogOption = true;
 			break; case 'm': parse(&maximum, optarg);
 			break; case 'n': name = optarg;
+			break; case 'o': once = true;
+			break; case 'p': raw = absolute(optarg);
+			break; case 'r': remote = optarg;
+			break; case 's': control = optarg;
 			break; case 't': parse(&restart, optarg);
+			break; case 'u': parse(&rollUptime, optarg);
+			break; case 'w': watchFile(optarg); watching = true;
 			break; default: return 1;
 		}
 	}
 	argc -= optind;
 	argv += optind;
 	if (!argc) errx(1, "no command");
+	if (notify >= 0 && notify <= STDERR_FILENO) errx(1, "invalid notify fd");
+	if (bench || parallel) daemonize = false;
+	init = (getpid() == 1);
+	if (init) daemonize = false;
+	// As init, pass output straight through unless it is to be logged.
+	bool passthrough = init && !syslogOption && !raw && !remote && !file
+		&& !control && !recorder.cap && !sample.rate;
 	if (!name) {
 		name = strrchr(argv[0], '/');
 		name = (name ? &name[1] : argv[0]);
 	}
+	if (raw && remote) errx(1, "-p and -r are mutually exclusive");
+	if (raw && file) errx(1, "-p and -f are mutually exclusive");
+	if (job && timerisset(&lifetime)) {
+		errx(1, "-j and -L are mutually exclusive");
+	}
+	if (job && watching) errx(1, "-j cannot be used with -e or -w");
+	// Workers have no flight recorder, counters or readiness pipe.
+	if (
+		parallel &&
+		(raw || job || bench || once || watching || boost || cores ||
+		counters || memory || notify >= 0 || recorder.cap ||
+		timerisset(&lifetime))
+	) {
+		errx(
+			1, "-P cannot be used with -B, -C, -D, -E, -L, -M, -N, -b, -e, -j, "
+			"-o, -p or -w"
+		);
+	}
+	if (
+		scaleMax &&
+		(raw || job || bench || once || watching || parallel || boost ||
+		cores || counters || memory || notify >= 0 || recorder.cap ||
+		timerisset(&lifetime))
+	) {
+		errx(
+			1, "-U cannot be used with -B, -C, -D, -E, -L, -M, -N, -P, -b, -e, "
+			"-j, -o, -p or -w"
+		);
+	}
+	if (scaleMax && !cgroup) errx(1, "-U requires -g");
+#ifndef __linux__
+	if (counters) errx(1, "-C is only supported on Linux");
+#endif
+	if (parallel) workInit(items ? items : "-", parallel, attempts);
+	if (scaleMax) {
+		replicaInit(scaleMin, scaleMax, scaleLow, scaleHigh, &rollUptime);
+	}
+	logSyslog = syslogOption || (!raw && !remote);
+	if (logSyslog) sinkAdd(&syslogSink);
+	if (raw) rawInit(raw, recorder.cap);
+	if (file) fileInit(file);
+	if (remote) remoteInit(name, remote);
+	if (control) controlInit(control);
+	if (cgroup) cgroupInit(cgroup);
+	oomInit(cgroup, score, memory);
+	if (boost) boostInit(strtol(boost, NULL, 10), &boostTimeout);
+	if (cores) coreInit(cores, name, argv[0], keep);
+	if (watchExecutable) watchExec(argv[0]);
+	if (watching) watchInit();
+	if (trace) traceInit(trace);
+	if (recorder.cap) {
+		recorder.buf = malloc(recorder.cap);
+		if (!recorder.buf) err(1, "malloc");
+	}
 
 #ifdef __OpenBSD__
-	error = pledge("stdio rpath proc exec", NULL);
+	char promises[64] = "stdio rpath proc exec";
+	if (remote) strlcat(promises, " inet dns", sizeof(promises));
+	if (remote || control) strlcat(promises, " unix", sizeof(promises));
+	if (raw || file || trace || cgroup || cores) {
+		strlcat(promises, " wpath", sizeof(promises));
+	}
+	if (raw || file || trace || control || cores) {
+		strlcat(promises, " cpath", sizeof(promises));
+	}
+	if (raw) strlcat(promises, " unix", sizeof(promises));
+	error = pledge(promises, NULL);
 	if (error) err(1, "pledge");
 #endif
 
@@ -145,7 +715,7 @@ int main(int argc, char *argv[]) {
 	struct LineBuffer stdoutBuffer = {0};
 	struct LineBuffer stderrBuffer = {0};
 
-	openlog(name, LOG_NDELAY | LOG_PERROR, LOG_DAEMON);
+	openlog(name, (init ? 0 : LOG_NDELAY) | LOG_PERROR, LOG_DAEMON);
 	if (daemonize) {
 		error = daemon(0, 0);
 		if (error) {
@@ -154,6 +724,7 @@ int main(int argc, char *argv[]) {
 		}
 	}
 	setproctitle("%s", name);
+	if (counters) perfInit();
 
 	signal(SIGHUP, signalHandler);
 	signal(SIGINT, signalHandler);
@@ -163,141 +734,504 @@ int main(int argc, char *argv[]) {
 	signal(SIGINFO, signalHandler);
 	signal(SIGUSR1, signalHandler);
 	signal(SIGUSR2, signalHandler);
+	// A reader of -p going away must fail splice(2) or write(2), not kill
+	// kitd. Sockets elsewhere are written with MSG_NOSIGNAL.
+	signal(SIGPIPE, SIG_IGN);
+	if (init) {
+		for (int sig = 1; sig < NSIG; ++sig) {
+			switch (sig) {
+				case SIGKILL: case SIGSTOP: case SIGPIPE:
+				case SIGABRT: case SIGBUS: case SIGFPE: case SIGILL:
+				case SIGSEGV: case SIGSYS: case SIGTRAP:
+					continue;
+			}
+			signal(sig, signalHandler);
+		}
+	}
+
+	if (parallel) {
+		int status = workRun(argv, control, &restart, &maximum);
+		if (trace) traceDump();
+		return status;
+	}
+	struct Backoff backoff = {
+		.restart = restart, .cooloff = cooloff, .maximum = maximum,
+	};
+	backoffReset(&backoff);
+	if (scaleMax) {
+		int status = replicaRun(argv, control, &backoff);
+		if (trace) traceDump();
+		return status;
+	}
 
-	pid_t child = 0;
 	bool stop = false;
+	bool expired = false;
+	struct timeval expiry = {0};
+	bool queued = false;
+	bool timedOut = false;
+	struct timeval overdue = {0};
+	struct timeval killing = {0};
+	bool killed = false;
+	int exitStatus = 0;
 	struct timeval uptime = {0};
-	struct timeval interval = restart;
-	signals[SIGALRM] = 1;
+	// Jobs are started by their schedule instead.
+	signals[SIGALRM] = !job;
 
 	sigset_t mask, unmask;
 	sigfillset(&mask);
 	sigemptyset(&unmask);
 	sigprocmask(SIG_SETMASK, &mask, NULL);
-	struct pollfd fds[2] = {
-		{ .fd = stdoutRW[0], .events = POLLIN },
-		{ .fd = stderrRW[0], .events = POLLIN },
-	};
+	struct pollfd fds[FdCap];
+	for (size_t i = 0; i < FdCap; ++i) {
+		fds[i] = (struct pollfd) { .fd = -1 };
+	}
+	fds[FdStdout].fd = stdoutRW[0];
+	fds[FdStderr].fd = stderrRW[0];
 	for (;;) {
 		struct timeval now;
-		struct timespec nowspec;
-		clock_gettime(CLOCK_MONOTONIC, &nowspec);
-		TIMESPEC_TO_TIMEVAL(&now, &nowspec);
+		monotonic(&now);
+		sampleUpdate(&now);
 
-		if (signals[SIGALRM]) {
+		if (signals[SIGALRM] && !oomHold(&now)) {
 			assert(!child);
+			// The status pipe is closed by a successful exec, or carries
+			// errno from a failed one.
+			int execRW[2];
+			error = pipe2(execRW, O_CLOEXEC);
+			if (error) {
+				syslog(LOG_ERR, "pipe2: %m");
+				return 1;
+			}
+			int notifyRW[2] = { -1, -1 };
+			if (notify >= 0) {
+				error = pipe2(notifyRW, O_CLOEXEC);
+				if (error) {
+					syslog(LOG_ERR, "pipe2: %m");
+					return 1;
+				}
+			}
+			// Hold the child until its counters are open.
+			int goRW[2] = { -1, -1 };
+			if (counters) {
+				error = pipe2(goRW, O_CLOEXEC);
+				if (error) {
+					syslog(LOG_ERR, "pipe2: %m");
+					return 1;
+				}
+			}
+			// Boost the cgroup before the child can run in it.
+			boostFork(&now);
+			unsigned long long start = traceBegin();
 			child = fork();
 			if (child < 0) {
 				syslog(LOG_ERR, "fork: %m");
 				return 1;
 			}
 			if (child) {
+				traceEnd(PhaseFork, start);
+				PROBE1(fork, child);
+				startupFork(&now);
+				if (timerisset(&lifetime)) {
+					// Spread restarts so replicas do not all go at once.
+					struct timeval delay = spread(&jitter);
+					timeradd(&now, &lifetime, &expiry);
+					timeradd(&expiry, &delay, &expiry);
+				}
+				freezeFork(child);
+				oomFork();
+				if (cores) coreFork();
+				if (job) jobStart(&now);
+				if (job && timerisset(&timeout)) {
+					timeradd(&now, &timeout, &overdue);
+				}
+				if (counters) {
+					perfOpen(child);
+					close(goRW[0]);
+					close(goRW[1]);
+				}
+				close(execRW[1]);
+				fds[FdExec] = (struct pollfd) { .fd = execRW[0], .events = POLLIN };
+				if (notify >= 0) {
+					close(notifyRW[1]);
+					fds[FdNotify] = (struct pollfd) {
+						.fd = notifyRW[0], .events = POLLIN,
+					};
+				}
 				uptime = now;
+				stdoutBuffer.pid = stderrBuffer.pid = child;
+				recorder.len = 0;
+				if (raw) rawReset();
 				signals[SIGALRM] = 0;
 			} else {
 				setpgid(0, 0);
-				dup2(stdoutRW[1], STDOUT_FILENO);
-				dup2(stderrRW[1], STDERR_FILENO);
+				// Warnings from here on are logged as the child's output.
+				if (!passthrough) {
+					dup2(stdoutRW[1], STDOUT_FILENO);
+					dup2(stderrRW[1], STDERR_FILENO);
+				}
+				cgroupJoin();
+				oomAdjust();
+				boostJoin();
+				if (cores) coreLimit();
+				// Move the pipes still needed out of the way of notify.
+				if (execRW[1] == notify) {
+					execRW[1] = fcntl(execRW[1], F_DUPFD_CLOEXEC, notify + 1);
+				}
+				for (int i = 0; i < 2; ++i) {
+					if (goRW[i] != notify) continue;
+					goRW[i] = fcntl(goRW[i], F_DUPFD_CLOEXEC, notify + 1);
+				}
+				if (notifyRW[1] == notify) {
+					fcntl(notify, F_SETFD, 0);
+				} else if (notify >= 0) {
+					dup2(notifyRW[1], notify);
+				}
+				if (counters) {
+					close(goRW[1]);
+					char c;
+					read(goRW[0], &c, 1);
+				}
+				signal(SIGPIPE, SIG_DFL);
 				sigprocmask(SIG_SETMASK, &unmask, NULL);
+				PROBE1(exec, argv[0]);
 				execvp(argv[0], (char *const *)argv);
+				int execErrno = errno;
+				write(execRW[1], &execErrno, sizeof(execErrno));
+				errno = execErrno;
 				err(127, "%s", argv[0]);
 			}
 		}
 
-		if (signals[SIGHUP]) {
-			if (child) killpg(child, SIGHUP);
-			signals[SIGHUP] = 0;
+		for (int sig; 0 != (sig = signalTake());) {
+			if (sig == SIGINT || sig == SIGTERM) stop = true;
+			if (child) forward(sig);
 		}
-		if (signals[SIGUSR1]) {
-			if (child) killpg(child, SIGUSR1);
-			signals[SIGUSR1] = 0;
+		if (stop && !child) break;
+
+		// Timers stand still while the child is frozen.
+		struct timeval paused;
+		if (thawed(&paused)) {
+			if (timerisset(&expiry)) timeradd(&expiry, &paused, &expiry);
+			if (timerisset(&overdue)) timeradd(&overdue, &paused, &overdue);
+			if (timerisset(&killing)) timeradd(&killing, &paused, &killing);
+			if (job) jobPause(&paused);
+			boostPause(&paused);
+		}
+
+		if (
+			child && !frozen() && timerisset(&expiry) &&
+			timercmp(&now, &expiry, >=)
+		) {
+			time_t wait = (window.set ? windowWait() : 0);
+			if (wait) {
+				// Those held for the window would otherwise all restart as
+				// it opens, so spread them into it by the jitter.
+				struct timeval open = { .tv_sec = wait };
+				struct timeval max = { .tv_sec = windowLength() - 1 };
+				if (timercmp(&jitter, &max, <)) max = jitter;
+				struct timeval delay = spread(&max);
+				timeradd(&now, &open, &expiry);
+				timeradd(&expiry, &delay, &expiry);
+			} else {
+				syslog(LOG_NOTICE, "child reached its maximum lifetime");
+				timerclear(&expiry);
+				expired = true;
+				forward(SIGTERM);
+				timeradd(&now, &Drain, &killing);
+			}
+		}
+
+		if (
+			child && !frozen() && timerisset(&overdue) &&
+			timercmp(&now, &overdue, >=)
+		) {
+			syslog(LOG_NOTICE, "stopping run at its timeout");
+			timerclear(&overdue);
+			timedOut = true;
+			forward(SIGTERM);
+			timeradd(&now, &Drain, &killing);
 		}
-		if (signals[SIGUSR2]) {
-			if (child) killpg(child, SIGUSR2);
-			signals[SIGUSR2] = 0;
+
+		// A child that ignores SIGTERM is stopped all the same.
+		if (
+			child && !frozen() && timerisset(&killing) &&
+			timercmp(&now, &killing, >=)
+		) {
+			syslog(LOG_WARNING, "killing child");
+			timerclear(&killing);
+			killed = true;
+			forward(SIGKILL);
 		}
 
-		if (signals[SIGINT] || signals[SIGTERM]) {
-			stop = true;
-			int sig = (signals[SIGINT] ? SIGINT : SIGTERM);
+		if (watching && watchChanged(&now)) {
+			// Like a lifetime, a new executable is no reason for backoff.
 			if (child) {
-				killpg(child, sig);
+				syslog(LOG_NOTICE, "restarting for the change");
+				expired = true;
+				forward(SIGTERM);
+				if (!timerisset(&killing)) timeradd(&now, &Drain, &killing);
 			} else {
-				break;
+				struct itimerval timer = {0};
+				setitimer(ITIMER_REAL, &timer, NULL);
+				backoffReset(&backoff);
+				signals[SIGALRM] = 1;
+			}
+		}
+
+		if (job && !frozen() && jobDue(&now)) {
+			if (!child) {
+				// The scheduled run takes the place of any pending retry.
+				struct itimerval timer = {0};
+				setitimer(ITIMER_REAL, &timer, NULL);
+				backoffReset(&backoff);
+				signals[SIGALRM] = 1;
+			} else if (overlap == Skip) {
+				syslog(LOG_NOTICE, "skipping run while the last is running");
+				jobSkip();
+			} else if (!queued) {
+				queued = true;
+				if (overlap == Kill) {
+					syslog(LOG_NOTICE, "stopping the last run");
+					forward(SIGTERM);
+					timeradd(&now, &Drain, &killing);
+				}
 			}
-			signals[sig] = 0;
 		}
 
-		if (signals[SIGCHLD]) {
+		if (caught(SIGCHLD)) {
 			int status;
-			pid_t pid = wait(&status);
-			signals[SIGCHLD] = 0;
-			if (pid < 0) {
-				syslog(LOG_ERR, "wait: %m");
-				continue;
+			struct rusage usage;
+			pid_t pid = child;
+			if (!reap(&status, &usage)) continue;
+			child = 0;
+			boostEnd(NULL);
+			freezeExit();
+			timerclear(&expiry);
+			timerclear(&overdue);
+			timerclear(&killing);
+			PROBE2(exit, pid, status);
+			startupExit(&now);
+			if (counters) {
+				struct timeval ran;
+				timersub(&now, &uptime, &ran);
+				perfClose(&ran);
 			}
-			if (pid != child) {
-				syslog(LOG_NOTICE, "unknown child %d", pid);
-				continue;
+			for (int i = FdExec; i <= FdNotify; ++i) {
+				if (fds[i].fd >= 0) close(fds[i].fd);
+				fds[i].fd = -1;
 			}
-			child = 0;
 
+			bool abnormal = false;
+			// A SIGKILL of our own is not the OOM killer's.
+			bool oom = !killed && oomKilled(status);
+			killed = false;
+			if (oom) syslog(LOG_WARNING, "child was killed out of memory");
 			if (WIFEXITED(status)) {
 				int exit = WEXITSTATUS(status);
-				if (exit == 127) stop = true;
-				if (exit) syslog(LOG_NOTICE, "child exited %d", exit);
+				exitStatus = exit;
+				if (exit && !oom) syslog(LOG_NOTICE, "child exited %d", exit);
+				abnormal = (exit != 0);
 			} else if (WIFSIGNALED(status)) {
 				int sig = WTERMSIG(status);
-				if (sig != SIGTERM) {
+				exitStatus = 128 + sig;
+				if (sig != SIGTERM && !oom) {
 					syslog(LOG_NOTICE, "child got %s", strsignal(sig));
 				}
+				// The restart need not wait for the core to be saved.
+				if (WCOREDUMP(status)) syslog(LOG_NOTICE, "child dumped core");
+				if (WCOREDUMP(status) && cores) coreSave(pid);
+				abnormal = (sig != SIGTERM);
+			}
+			if (abnormal && recorder.cap && raw) {
+				rawDrain(fds[FdStdout].fd, Stdout);
+				rawDrain(fds[FdStderr].fd, Stderr);
+				rawRecord();
+			} else if (abnormal && recorder.cap) {
+				lbDrain(&stdoutBuffer, fds[FdStdout].fd, Stdout, LOG_INFO);
+				lbDrain(&stderrBuffer, fds[FdStderr].fd, Stderr, LOG_NOTICE);
+			}
+			if (abnormal && recorder.cap) {
+				syslog(
+					LOG_NOTICE, "child used %ld.%03lds user %ld.%03lds system %ldK",
+					(long)usage.ru_utime.tv_sec, (long)usage.ru_utime.tv_usec / 1000,
+					(long)usage.ru_stime.tv_sec, (long)usage.ru_stime.tv_usec / 1000,
+					(long)usage.ru_maxrss
+				);
+				recorderDump();
 			}
 
-			if (stop) break;
 			timersub(&now, &uptime, &uptime);
-			if (timercmp(&uptime, &cooloff, >=)) {
-				interval = restart;
+			struct Exit last = {
+				.status = status,
+				.uptime = uptime,
+				.stop = stop || once,
+				.planned = expired,
+				.job = job,
+				.queued = queued,
+				.timedOut = timedOut,
+			};
+			struct timeval interval;
+			enum Restart restart = restartNext(&backoff, &last, &interval);
+			if (restart == RestartStop) break;
+			if (bench && !--bench) {
+				startupPrint();
+				break;
 			}
-			syslog(LOG_INFO, "restarting in %s", humanize(&interval));
-			struct itimerval timer = { .it_value = interval };
-			setitimer(ITIMER_REAL, &timer, NULL);
-
-			timeradd(&interval, &interval, &interval);
-			if (timercmp(&interval, &maximum, >)) {
-				interval = maximum;
+			if (bench) {
+				signals[SIGALRM] = 1;
+				continue;
+			}
+			if (job) jobExit(&now, status, timedOut);
+			if (expired) syslog(LOG_INFO, "restarting");
+			expired = queued = timedOut = false;
+			// Only failures are retried, until the next run is due.
+			if (restart == RestartSchedule) continue;
+			if (restart == RestartNow) {
+				signals[SIGALRM] = 1;
+				continue;
+			}
+			syslog(
+				LOG_INFO, "%s in %s",
+				(job ? "retrying" : "restarting"), humanize(&interval)
+			);
+			PROBE1(restart, interval.tv_sec * 1000 + interval.tv_usec / 1000);
+			if (timerisset(&interval)) {
+				struct itimerval timer = { .it_value = interval };
+				setitimer(ITIMER_REAL, &timer, NULL);
+			} else {
+				// A zero timer would disarm rather than fire.
+				signals[SIGALRM] = 1;
 			}
 		}
 
-		if (signals[SIGINFO]) {
+		if (caught(SIGINFO)) {
 			if (child) {
 				struct timeval time;
 				timersub(&now, &uptime, &time);
 				syslog(LOG_INFO, "child %d up %s", child, humanize(&time));
+				struct timeval end = expiry;
+				if (frozenFor(&time)) {
+					syslog(LOG_INFO, "child frozen for %s", humanize(&time));
+					timeradd(&end, &time, &end);
+				}
+				if (timerisset(&expiry)) {
+					timersub(&end, &now, &time);
+					syslog(LOG_INFO, "lifetime ends in %s", humanize(&time));
+				}
 			} else {
 				struct itimerval timer;
 				getitimer(ITIMER_REAL, &timer);
-				syslog(LOG_INFO, "restarting in %s", humanize(&timer.it_value));
+				if (!job || timerisset(&timer.it_value)) {
+					syslog(
+						LOG_INFO, "restarting in %s", humanize(&timer.it_value)
+					);
+				}
+			}
+			if (job) {
+				struct timeval time = {0};
+				if (timercmp(jobNext(), &now, >)) {
+					timersub(jobNext(), &now, &time);
+				}
+				syslog(LOG_INFO, "next run in %s", humanize(&time));
+			}
+			outputInfo();
+			const char *info;
+			for (size_t i = 0; NULL != (info = startupInfo(i)); ++i) {
+				syslog(LOG_INFO, "%s", info);
+			}
+			for (size_t i = 0; NULL != (info = jobInfo(i)); ++i) {
+				syslog(LOG_INFO, "%s", info);
+			}
+			for (size_t i = 0; NULL != (info = oomInfo(i)); ++i) {
+				syslog(LOG_INFO, "%s", info);
 			}
-			signals[SIGINFO] = 0;
 		}
 
-		int nfds = ppoll(fds, 2, NULL, &unmask);
+		struct timeval deadline = {0};
+		// Restart at once rather than waiting in ppoll(2) for a signal.
+		if (signals[SIGALRM] && !oomHold(&now)) deadline = now;
+		oomPoll(&deadline);
+		boostPoll(&now, &deadline);
+		if (timerisset(&expiry) && !frozen()) deadlineMin(&deadline, &expiry);
+		if (timerisset(&overdue) && !frozen()) {
+			deadlineMin(&deadline, &overdue);
+		}
+		if (timerisset(&killing) && !frozen()) {
+			deadlineMin(&deadline, &killing);
+		}
+		if (job && !frozen()) deadlineMin(&deadline, jobNext());
+		bool room = outputPoll(&fds[FdRemote], &now, &deadline);
+		fds[FdStdout].events = fds[FdStderr].events = (room ? POLLIN : 0);
+		if (raw) {
+			rawPoll(&fds[FdRaw], &now, &deadline);
+			if (rawBlocked()) fds[FdStdout].events = fds[FdStderr].events = 0;
+		}
+		if (watching) watchPoll(&fds[FdWatch], &now, &deadline);
+		if (control) controlPoll(&fds[FdControl]);
+
+		struct timespec timeout;
+		if (timerisset(&deadline)) {
+			struct timeval wait = {0};
+			if (timercmp(&deadline, &now, >)) timersub(&deadline, &now, &wait);
+			TIMEVAL_TO_TIMESPEC(&wait, &timeout);
+		}
+		unsigned long long start = traceBegin();
+		int nfds = ppoll(
+			fds, FdCap, (timerisset(&deadline) ? &timeout : NULL), &unmask
+		);
+		if (tracing) {
+			traceWake(start, (nfds > 0 ? WakeFd : nfds ? WakeSignal : WakeTimer));
+		}
 		if (nfds < 0 && errno != EINTR) {
 			syslog(LOG_ERR, "poll: %m");
 			continue;
 		}
-		if (nfds > 0 && fds[0].revents) {
-			lbFill(&stdoutBuffer, fds[0].fd);
-			lbFlush(&stdoutBuffer, LOG_INFO);
+		if (nfds > 0) {
+			struct timeval woke;
+			monotonic(&woke);
+			if (fds[FdExec].revents) {
+				int execErrno;
+				if (!read(fds[FdExec].fd, &execErrno, sizeof(execErrno))) {
+					started(StartExec, &woke);
+				}
+				close(fds[FdExec].fd);
+				fds[FdExec].fd = -1;
+			}
+			if (fds[FdNotify].revents) {
+				char buf[256];
+				ssize_t len = read(fds[FdNotify].fd, buf, sizeof(buf));
+				bool ready = (len > 0 && memchr(buf, '\n', len));
+				if (ready) started(StartReady, &woke);
+				if (ready || len <= 0) {
+					close(fds[FdNotify].fd);
+					fds[FdNotify].fd = -1;
+				}
+			}
+			if (child && (fds[FdStdout].revents || fds[FdStderr].revents)) {
+				started(StartOutput, &woke);
+			}
+			if (watching) watchEvent(fds[FdWatch].revents, &woke);
 		}
-		if (nfds > 0 && fds[1].revents) {
-			lbFill(&stderrBuffer, fds[1].fd);
-			lbFlush(&stderrBuffer, LOG_NOTICE);
+		if (raw && nfds > 0) {
+			rawEvent(fds[FdRaw].revents);
+			if (fds[FdStdout].revents) rawDrain(fds[FdStdout].fd, Stdout);
+			if (fds[FdStderr].revents) rawDrain(fds[FdStderr].fd, Stderr);
+		} else if (nfds > 0) {
+			if (fds[FdStdout].revents) {
+				lbDrain(&stdoutBuffer, fds[FdStdout].fd, Stdout, LOG_INFO);
+			}
+			if (fds[FdStderr].revents) {
+				lbDrain(&stderrBuffer, fds[FdStderr].fd, Stderr, LOG_NOTICE);
+			}
 		}
+		outputEvent(&fds[FdRemote], nfds);
+		if (control && nfds >= 0) controlEvent(&fds[FdControl]);
 	}
 
-	lbFill(&stdoutBuffer, fds[0].fd);
-	lbFill(&stderrBuffer, fds[1].fd);
-	lbFlush(&stdoutBuffer, LOG_INFO);
-	lbFlush(&stderrBuffer, LOG_NOTICE);
+	if (raw) rawFinish((int[]) { fds[FdStdout].fd, fds[FdStderr].fd });
+	lbFinish(&stdoutBuffer, fds[FdStdout].fd, Stdout, LOG_INFO);
+	lbFinish(&stderrBuffer, fds[FdStderr].fd, Stderr, LOG_NOTICE);
+	if (control) controlClose();
+	if (trace) traceDump();
+	return (init || once ? exitStatus : 0);
 }
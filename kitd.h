@@ -0,0 +1,279 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+
+// USDT probes for dtrace(1), bpftrace(8) and the like, where available.
+#ifdef __has_include
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE1(name, a) DTRACE_PROBE1(kitd, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(kitd, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(kitd, name, a, b, c)
+#endif
+#endif
+#ifndef PROBE1
+#define PROBE1(name, a) ((void)(a))
+#define PROBE2(name, a, b) ((void)(a), (void)(b))
+#define PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#endif
+
+static inline void monotonic(struct timeval *now) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	TIMESPEC_TO_TIMEVAL(now, &time);
+}
+
+// Lower deadline to time if time is earlier or deadline is unset.
+static inline void deadlineMin(struct timeval *deadline, const struct timeval *time) {
+	if (!timerisset(deadline) || timercmp(time, deadline, <)) *deadline = *time;
+}
+
+enum Stream { Stdout, Stderr, StreamCap };
+extern const char *StreamNames[StreamCap];
+
+enum Overflow { Block, Drop };
+struct Sink {
+	const char *name;
+	enum Overflow overflow;
+	bool up;
+	unsigned long long records;
+	unsigned long long drops;
+	unsigned long long writes;
+	struct timeval since;
+	struct timeval total;
+	struct timeval max;
+};
+void sinkAdd(struct Sink *sink);
+void sinkQueue(struct Sink *sink);
+void sinkWrote(struct Sink *sink, bool empty);
+const char *sinkInfo(size_t i);
+unsigned long long sinkDrops(void);
+const char *sinkStamp(void);
+
+enum Phase { PhasePoll, PhaseFill, PhaseFlush, PhaseSyslog, PhaseFork, PhaseCap };
+enum Wake { WakeFd, WakeSignal, WakeTimer, WakeCap };
+extern bool tracing;
+void traceInit(const char *path);
+unsigned long long traceClock(void);
+void traceSpan(enum Phase phase, unsigned long long start);
+void traceWake(unsigned long long start, enum Wake wake);
+const char *traceInfo(size_t i);
+int traceDump(void);
+
+// Time a phase of the loop only when tracing.
+static inline unsigned long long traceBegin(void) {
+	return (tracing ? traceClock() : 0);
+}
+static inline void traceEnd(enum Phase phase, unsigned long long start) {
+	if (tracing) traceSpan(phase, start);
+}
+
+struct Backoff {
+	struct timeval restart;
+	struct timeval cooloff;
+	struct timeval maximum;
+	struct timeval interval;
+};
+void backoffReset(struct Backoff *backoff);
+struct timeval backoffNext(struct Backoff *backoff, const struct timeval *uptime);
+
+enum Restart { RestartStop, RestartNow, RestartSchedule, RestartDelay };
+struct Exit {
+	int status;
+	struct timeval uptime;
+	bool stop;
+	bool planned;
+	bool job;
+	bool queued;
+	bool timedOut;
+};
+const char *parseInterval(struct timeval *interval, const char *str);
+bool runOk(int status, bool timedOut);
+enum Restart restartNext(struct Backoff *backoff, const struct Exit *exit, struct timeval *delay);
+
+struct Percentiles {
+	unsigned long long min;
+	unsigned long long p50;
+	unsigned long long p90;
+	unsigned long long p99;
+	unsigned long long p999;
+	unsigned long long max;
+};
+void percentiles(struct Percentiles *pct, unsigned long long *samples, size_t len);
+
+enum Start { StartBackoff, StartExec, StartOutput, StartReady, StartCap };
+void startupFork(const struct timeval *now);
+bool startupMark(enum Start start, const struct timeval *now);
+void startupExit(const struct timeval *now);
+const char *startupInfo(size_t i);
+void startupPrint(void);
+
+enum Overlap { Skip, Queue, Kill };
+void jobEvery(const struct timeval *every);
+void jobCalendar(const char *str);
+bool jobDue(const struct timeval *now);
+const struct timeval *jobNext(void);
+void jobPause(const struct timeval *paused);
+void jobStart(const struct timeval *now);
+void jobSkip(void);
+void jobExit(const struct timeval *now, int status, bool timedOut);
+const char *jobInfo(size_t i);
+
+void cgroupInit(const char *dir);
+void cgroupJoin(void);
+int cgroupUsage(unsigned long long *usec);
+void freezeFork(pid_t pid);
+void freezeExit(void);
+bool frozen(void);
+bool frozenFor(struct timeval *time);
+const char *freeze(void);
+const char *thaw(void);
+bool thawed(struct timeval *paused);
+void boostInit(int value, const struct timeval *timeout);
+void boostJoin(void);
+void boostFork(const struct timeval *now);
+void boostEnd(const char *reason);
+void boostPause(const struct timeval *paused);
+void boostPoll(const struct timeval *now, struct timeval *deadline);
+
+void coreInit(
+	const char *dir, const char *name, const char *command, size_t keep
+);
+void coreLimit(void);
+void coreFork(void);
+void coreSave(pid_t pid);
+bool coreReap(pid_t pid);
+
+void oomInit(const char *cgroup, const char *score, size_t memory);
+void oomAdjust(void);
+void oomFork(void);
+bool oomKilled(int status);
+bool oomHold(const struct timeval *now);
+void oomPoll(struct timeval *deadline);
+const char *oomInfo(size_t i);
+
+void watchFile(const char *path);
+void watchExec(const char *name);
+void watchInit(void);
+void watchPoll(struct pollfd *pfd, const struct timeval *now, struct timeval *deadline);
+void watchEvent(short revents, const struct timeval *now);
+bool watchChanged(const struct timeval *now);
+
+void perfInit(void);
+void perfOpen(pid_t pid);
+void perfClose(const struct timeval *uptime);
+
+void fileInit(const char *path);
+void filePoll(struct pollfd *pfd, const struct timeval *now, struct timeval *deadline);
+void fileEvent(short revents);
+void fileRecord(enum Stream stream, const char *msg);
+void fileFlush(void);
+bool fileBlocked(void);
+
+void remoteInit(const char *app, const char *remote);
+void remotePoll(struct pollfd *pfd, const struct timeval *now, struct timeval *deadline);
+void remoteEvent(short revents);
+void remoteRecord(int priority, pid_t pid, const char *msg);
+void remoteFlush(void);
+bool remoteBlocked(void);
+void remoteDrain(void);
+
+extern const struct timeval Drain;
+const char *humanize(const struct timeval *interval);
+int signalTake(void);
+bool caught(int sig);
+
+struct LineBuffer {
+	const char *tag;
+	pid_t pid;
+	size_t len;
+	char buf[16 * 1024];
+};
+void recorderWrite(const char *ptr, size_t len);
+void lbFlush(struct LineBuffer *lb, enum Stream stream, int priority);
+void lbDrain(struct LineBuffer *lb, int fd, enum Stream stream, int priority);
+void lbFinish(struct LineBuffer *lb, int fd, enum Stream stream, int priority);
+void sampleUpdate(const struct timeval *now);
+bool outputPoll(
+	struct pollfd fds[static 2], const struct timeval *now,
+	struct timeval *deadline
+);
+void outputEvent(const struct pollfd fds[static 2], int nfds);
+void outputDrain(void);
+void outputInfo(void);
+
+void rawInit(const char *path, size_t recorderCap);
+void rawPoll(struct pollfd *pfd, const struct timeval *now, struct timeval *deadline);
+void rawEvent(short revents);
+bool rawBlocked(void);
+void rawDrain(int src, enum Stream stream);
+void rawRecord(void);
+void rawReset(void);
+void rawFinish(int fds[static StreamCap]);
+void rawInfo(void);
+
+enum { ClientCap = 16 };
+extern size_t subscribers;
+void controlInit(const char *path);
+void controlClose(void);
+void controlPoll(struct pollfd fds[static 1 + ClientCap]);
+void controlEvent(const struct pollfd fds[static 1 + ClientCap]);
+void controlRecord(enum Stream stream, int priority, const char *msg);
+
+enum {
+	SlotRemote,
+	SlotFile,
+	SlotControl,
+	SlotWorkers = SlotControl + 1 + ClientCap,
+};
+struct Worker {
+	pid_t pid;
+	const char *tag;
+	struct Item *item;
+	struct timeval start;
+	int fds[StreamCap];
+	struct LineBuffer lbs[StreamCap];
+};
+bool workerStart(
+	struct Worker *worker, char *argv[], const char *item,
+	const struct timeval *now
+);
+void workerFinish(struct Worker *worker);
+void workersSignal(struct Worker *workers, size_t len, int sig);
+void workersPoll(
+	struct pollfd *fds, struct Worker *workers, size_t len,
+	const char *control, const struct timeval *now, struct timeval *deadline
+);
+void workInit(const char *path, size_t parallel, unsigned attempts);
+int workRun(
+	char *argv[], const char *control,
+	const struct timeval *restart, const struct timeval *maximum
+);
+
+void replicaInit(
+	size_t min, size_t max, size_t low, size_t high,
+	const struct timeval *uptime
+);
+const char *rollRestart(size_t step);
+int replicaRun(
+	char *argv[], const char *control, const struct Backoff *backoff
+);
@@ -0,0 +1,169 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "kitd.h"
+
+static const struct timeval Check = { .tv_sec = 1 };
+
+static struct {
+	char events[PATH_MAX];
+	const char *score;
+	size_t memory;
+	unsigned long long before;
+	unsigned long long kills;
+	bool waiting;
+	struct timeval check;
+	char info[64];
+} oom;
+
+// The kernel counts OOM kills in the cgroup. A SIGKILL is put down to the
+// OOM killer when the count went up while the child was running. A shell
+// reports the kill of its own child as exit status 137.
+static int oomCount(unsigned long long *count) {
+	if (!oom.events[0]) return -1;
+	FILE *file = fopen(oom.events, "re");
+	if (!file) return -1;
+	char key[32];
+	unsigned long long value;
+	int error = -1;
+	while (2 == fscanf(file, "%31s %llu", key, &value)) {
+		if (strcmp(key, "oom_kill")) continue;
+		*count = value;
+		error = 0;
+		break;
+	}
+	fclose(file);
+	if (error) errno = EINVAL;
+	return error;
+}
+
+void oomInit(const char *cgroup, const char *score, size_t memory) {
+#ifndef __linux__
+	if (score) errx(1, "-S is only supported on Linux");
+	if (memory) errx(1, "-M is only supported on Linux");
+#endif
+	if (memory && !cgroup) errx(1, "-M requires -g");
+	if (score) {
+		char *end;
+		long n = strtol(score, &end, 10);
+		if (*end || n < -1000 || n > 1000) errx(1, "invalid score %s", score);
+	}
+	oom.score = score;
+	oom.memory = memory;
+	if (!cgroup) return;
+	snprintf(oom.events, sizeof(oom.events), "%s/memory.events", cgroup);
+	if (oomCount(&oom.before)) {
+		if (memory) err(1, "%s", oom.events);
+		oom.events[0] = '\0';
+	}
+}
+
+// Called in the child before exec.
+void oomAdjust(void) {
+	if (!oom.score) return;
+	int fd = open("/proc/self/oom_score_adj", O_WRONLY | O_CLOEXEC);
+	if (fd < 0 || write(fd, oom.score, strlen(oom.score)) < 0) {
+		warn("oom_score_adj");
+	}
+	if (fd >= 0) close(fd);
+}
+
+void oomFork(void) {
+	if (oomCount(&oom.before)) oom.before = ULLONG_MAX;
+}
+
+bool oomKilled(int status) {
+	bool killed = (WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL)
+		|| (WIFEXITED(status) && WEXITSTATUS(status) == 128 + SIGKILL);
+	if (!killed) return false;
+	unsigned long long count;
+	if (oomCount(&count) || count <= oom.before) return false;
+	oom.kills++;
+	oom.waiting = (oom.memory > 0);
+	timerclear(&oom.check);
+	return true;
+}
+
+static int available(unsigned long long *bytes) {
+	FILE *file = fopen("/proc/meminfo", "re");
+	if (!file) return -1;
+	char line[256];
+	int error = -1;
+	while (fgets(line, sizeof(line), file)) {
+		if (1 == sscanf(line, "MemAvailable: %llu kB", bytes)) {
+			*bytes <<= 10;
+			error = 0;
+			break;
+		}
+	}
+	fclose(file);
+	if (error) errno = ENOENT;
+	return error;
+}
+
+// Hold the restart after an OOM kill until there is memory to restart into.
+bool oomHold(const struct timeval *now) {
+	if (!oom.waiting) return false;
+	if (timercmp(now, &oom.check, <)) return true;
+	bool first = !timerisset(&oom.check);
+	timeradd(now, &Check, &oom.check);
+	unsigned long long bytes;
+	if (available(&bytes)) {
+		syslog(LOG_WARNING, "available memory: %m");
+		oom.waiting = false;
+		return false;
+	}
+	if (bytes >= oom.memory) {
+		if (!first) syslog(LOG_NOTICE, "memory recovered");
+		oom.waiting = false;
+		return false;
+	}
+	if (first) {
+		syslog(
+			LOG_NOTICE, "waiting for %zuK of memory, %lluK available",
+			oom.memory >> 10, bytes >> 10
+		);
+	}
+	return true;
+}
+
+void oomPoll(struct timeval *deadline) {
+	if (oom.waiting) deadlineMin(deadline, &oom.check);
+}
+
+const char *oomInfo(size_t i) {
+	if (i || !oom.events[0]) return NULL;
+	// Kills are always counted, but only reported if asked for or seen.
+	if (!oom.score && !oom.memory && !oom.kills) return NULL;
+	bool held = oom.waiting && timerisset(&oom.check);
+	snprintf(
+		oom.info, sizeof(oom.info), "%llu OOM kills%s",
+		oom.kills, (held ? ", waiting for memory" : "")
+	);
+	return oom.info;
+}
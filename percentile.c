@@ -0,0 +1,38 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "kitd.h"
+
+static int compare(const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+	return (x > y) - (x < y);
+}
+
+// Sort the samples in place and pick out their percentiles.
+void percentiles(struct Percentiles *pct, unsigned long long *samples, size_t len) {
+	*pct = (struct Percentiles) {0};
+	if (!len) return;
+	qsort(samples, len, sizeof(*samples), compare);
+	pct->min = samples[0];
+	pct->p50 = samples[len / 2];
+	pct->p90 = samples[len * 9 / 10];
+	pct->p99 = samples[len * 99 / 100];
+	pct->p999 = samples[len * 999 / 1000];
+	pct->max = samples[len - 1];
+}
@@ -0,0 +1,171 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "kitd.h"
+
+#ifdef __linux__
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+enum Event {
+	EventTask,
+	EventSwitches,
+	EventFaults,
+	EventInstructions,
+	EventCycles,
+	EventMisses,
+	EventCap,
+};
+
+static const struct {
+	unsigned type;
+	unsigned long long config;
+} Events[EventCap] = {
+	[EventTask] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	[EventSwitches] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	[EventFaults] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+	[EventInstructions] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[EventCycles] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[EventMisses] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+};
+
+static int fds[EventCap] = { -1, -1, -1, -1, -1, -1 };
+static bool hardware = true;
+static bool warned;
+
+static int eventOpen(enum Event event, pid_t pid, bool user) {
+	struct perf_event_attr attr = {
+		.type = Events[event].type,
+		.size = sizeof(attr),
+		.config = Events[event].config,
+		.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+			| PERF_FORMAT_TOTAL_TIME_RUNNING,
+		.disabled = 1,
+		.inherit = 1,
+		.enable_on_exec = 1,
+		.exclude_kernel = user,
+		.exclude_hv = 1,
+	};
+	return syscall(
+		SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC
+	);
+}
+
+// Virtual machines often have no PMU, leaving only software events.
+void perfInit(void) {
+	int fd = eventOpen(EventInstructions, 0, true);
+	if (fd < 0) {
+		syslog(LOG_NOTICE, "hardware counters unavailable: %m");
+		hardware = false;
+	}
+	if (fd >= 0) close(fd);
+}
+
+// Open counters on the child before it execs, counting from exec on.
+void perfOpen(pid_t pid) {
+	for (enum Event i = 0; i < EventCap; ++i) {
+		if (!hardware && Events[i].type == PERF_TYPE_HARDWARE) continue;
+		fds[i] = eventOpen(i, pid, false);
+		// Without privilege, only user space may be counted.
+		if (fds[i] < 0 && (errno == EACCES || errno == EPERM)) {
+			fds[i] = eventOpen(i, pid, true);
+		}
+		if (fds[i] < 0 && !warned) {
+			syslog(LOG_INFO, "counters: %m; counting what is available");
+			warned = true;
+		}
+	}
+}
+
+static bool eventRead(enum Event event, double *value) {
+	if (fds[event] < 0) return false;
+	unsigned long long buf[3];
+	ssize_t len = read(fds[event], buf, sizeof(buf));
+	close(fds[event]);
+	fds[event] = -1;
+	if (len != sizeof(buf) || !buf[2]) return false;
+	// Scale up counts from when the counter was multiplexed out.
+	*value = (double)buf[0] * buf[1] / buf[2];
+	return true;
+}
+
+void perfClose(const struct timeval *uptime) {
+	double secs = uptime->tv_sec + uptime->tv_usec / 1e6;
+	double values[EventCap];
+	bool have[EventCap];
+	for (enum Event i = 0; i < EventCap; ++i) {
+		have[i] = eventRead(i, &values[i]);
+	}
+
+	char buf[512] = "";
+	size_t len = 0;
+	if (have[EventTask]) {
+		len += snprintf(
+			&buf[len], sizeof(buf) - len, ", %.3fs task clock, %.2f CPUs",
+			values[EventTask] / 1e9, (secs ? values[EventTask] / 1e9 / secs : 0)
+		);
+	}
+	if (have[EventSwitches] && len < sizeof(buf)) {
+		len += snprintf(
+			&buf[len], sizeof(buf) - len, ", %.0f context switches, %.0f/s",
+			values[EventSwitches], (secs ? values[EventSwitches] / secs : 0)
+		);
+	}
+	if (have[EventFaults] && len < sizeof(buf)) {
+		len += snprintf(
+			&buf[len], sizeof(buf) - len, ", %.0f page faults, %.0f/s",
+			values[EventFaults], (secs ? values[EventFaults] / secs : 0)
+		);
+	}
+	if (have[EventInstructions] && have[EventCycles] && len < sizeof(buf)) {
+		len += snprintf(
+			&buf[len], sizeof(buf) - len, ", %.0f instructions, %.0f cycles, "
+			"%.2f IPC", values[EventInstructions], values[EventCycles],
+			(values[EventCycles] ? values[EventInstructions] / values[EventCycles] : 0)
+		);
+	}
+	if (have[EventInstructions] && have[EventMisses] && len < sizeof(buf)) {
+		len += snprintf(
+			&buf[len], sizeof(buf) - len,
+			", %.0f cache misses, %.2f per 1000 instructions",
+			values[EventMisses], (values[EventInstructions]
+				? values[EventMisses] * 1000 / values[EventInstructions] : 0)
+		);
+	}
+	if (buf[0]) syslog(LOG_INFO, "child counted%s", &buf[1]);
+}
+
+#else
+
+void perfInit(void) {
+}
+
+void perfOpen(pid_t pid) {
+	(void)pid;
+}
+
+void perfClose(const struct timeval *uptime) {
+	(void)uptime;
+}
+
+#endif
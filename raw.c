@@ -0,0 +1,328 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "kitd.h"
+
+enum { ChunkCap = 64 * 1024 };
+
+static const struct timeval Retry = { .tv_sec = 1 };
+
+static struct {
+	const char *path;
+	int fd;
+	bool blocked;
+	struct timeval retry;
+	unsigned long long bytes[StreamCap];
+	unsigned long long drops;
+	size_t len;
+#ifdef __linux__
+	int null;
+	int tee[2];
+	size_t teeCap;
+	int held[2];
+	enum Stream stream;
+#else
+	char buf[ChunkCap];
+#endif
+} raw = { .fd = -1 };
+
+static int rawOpen(void) {
+	struct stat st;
+	if (stat(raw.path, &st) || !S_ISSOCK(st.st_mode)) {
+		// splice(2) refuses files opened with O_APPEND.
+		int fd = open(raw.path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0) return -1;
+		lseek(fd, 0, SEEK_END);
+		return fd;
+	}
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(raw.path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, raw.path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	int error = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (error) {
+		int connectErrno = errno;
+		close(fd);
+		errno = connectErrno;
+		return -1;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+void rawInit(const char *path, size_t recorderCap) {
+	raw.path = path;
+	raw.fd = rawOpen();
+	if (raw.fd < 0) err(1, "%s", path);
+#ifdef __linux__
+	raw.null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (raw.null < 0) err(1, "/dev/null");
+	raw.tee[0] = raw.tee[1] = -1;
+	raw.held[0] = raw.held[1] = -1;
+	if (!recorderCap) return;
+	// Keep the recorded tail in a pipe of its own, so it is never copied
+	// out of the kernel unless it is needed.
+	// Pipe capacity is counted in pages however full they are, so leave
+	// plenty of room beyond the bytes actually kept.
+	int error = pipe2(raw.tee, O_CLOEXEC | O_NONBLOCK);
+	if (error) err(1, "pipe2");
+	size_t size = 2 * recorderCap;
+	if (size < ChunkCap) size = ChunkCap;
+	fcntl(raw.tee[1], F_SETPIPE_SZ, (int)size);
+	raw.teeCap = recorderCap;
+	// Recorded output waits here until it is written, so that a short write
+	// does not leave it to be recorded again.
+	error = pipe2(raw.held, O_CLOEXEC | O_NONBLOCK);
+	if (error) err(1, "pipe2");
+#else
+	(void)recorderCap;
+#endif
+}
+
+#ifdef __linux__
+static void discard(int fd, size_t len) {
+	while (len) {
+		ssize_t n = splice(fd, NULL, raw.null, NULL, len, SPLICE_F_NONBLOCK);
+		if (n <= 0) break;
+		len -= n;
+	}
+}
+#endif
+
+static void rawClose(void) {
+	close(raw.fd);
+	raw.fd = -1;
+	raw.blocked = false;
+	struct timeval time;
+	monotonic(&time);
+	timeradd(&time, &Retry, &raw.retry);
+#ifdef __linux__
+	discard(raw.held[0], raw.len);
+#endif
+	raw.drops += raw.len;
+	raw.len = 0;
+}
+
+static void writeError(void) {
+	syslog(LOG_WARNING, "%s: %m", raw.path);
+	rawClose();
+}
+
+#ifdef __linux__
+
+static void teeDiscard(size_t len) {
+	discard(raw.tee[0], len);
+}
+
+static ssize_t rawWrite(void) {
+	ssize_t n = splice(
+		raw.held[0], NULL, raw.fd, NULL, raw.len,
+		SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+	);
+	if (n < 0 && errno != EAGAIN) {
+		writeError();
+		return -1;
+	}
+	if (n > 0) {
+		raw.len -= n;
+		raw.bytes[raw.stream] += n;
+	}
+	raw.blocked = (raw.len > 0);
+	return n;
+}
+
+static ssize_t rawMove(int src, enum Stream stream) {
+	// Finish writing what was recorded before taking any more.
+	if (raw.len) {
+		ssize_t n = rawWrite();
+		if (n <= 0 || raw.len) return n;
+	}
+	int avail = 0;
+	ioctl(src, FIONREAD, &avail);
+	if (avail <= 0) return 0;
+	size_t len = (avail < ChunkCap ? avail : ChunkCap);
+	if (raw.fd < 0) {
+		ssize_t n = splice(src, NULL, raw.null, NULL, len, SPLICE_F_NONBLOCK);
+		if (n > 0) raw.drops += n;
+		return n;
+	}
+
+	// Only the end of the output is kept, so tee(2) just the last part, and
+	// only once it has been moved out of the way of the next read.
+	if (raw.tee[1] >= 0 && (size_t)avail <= raw.teeCap) {
+		ssize_t n = splice(
+			src, NULL, raw.held[1], NULL, len,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+		);
+		if (n <= 0) return n;
+		int queued = 0;
+		ioctl(raw.tee[0], FIONREAD, &queued);
+		size_t total = queued + n;
+		if (total > raw.teeCap) teeDiscard(total - raw.teeCap);
+		ssize_t teed = tee(raw.held[0], raw.tee[1], n, SPLICE_F_NONBLOCK);
+		if (teed < 0 && errno == EAGAIN) {
+			teeDiscard(queued);
+			tee(raw.held[0], raw.tee[1], n, SPLICE_F_NONBLOCK);
+		}
+		raw.len = n;
+		raw.stream = stream;
+		rawWrite();
+		return n;
+	}
+	if (raw.tee[1] >= 0 && len > avail - raw.teeCap) {
+		len = avail - raw.teeCap;
+	}
+
+	ssize_t n = splice(
+		src, NULL, raw.fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK
+	);
+	if (n < 0 && errno == EAGAIN) {
+		raw.blocked = true;
+	} else if (n < 0) {
+		writeError();
+	} else {
+		raw.bytes[stream] += n;
+	}
+	return n;
+}
+
+void rawRecord(void) {
+	if (raw.tee[0] < 0) return;
+	char buf[ChunkCap];
+	ssize_t len;
+	while (0 < (len = read(raw.tee[0], buf, sizeof(buf)))) {
+		recorderWrite(buf, len);
+	}
+}
+
+void rawReset(void) {
+	if (raw.tee[0] >= 0) teeDiscard(raw.teeCap);
+}
+
+#else
+
+static ssize_t rawWrite(void) {
+	ssize_t len = write(raw.fd, raw.buf, raw.len);
+	if (len < 0 && errno != EAGAIN) {
+		writeError();
+		return -1;
+	}
+	if (len > 0) {
+		raw.len -= len;
+		memmove(raw.buf, &raw.buf[len], raw.len);
+	}
+	raw.blocked = (raw.len > 0);
+	return len;
+}
+
+static ssize_t rawMove(int src, enum Stream stream) {
+	// Finish writing the last read before reading over it.
+	if (raw.len) {
+		ssize_t n = rawWrite();
+		if (n <= 0 || raw.len) return n;
+	}
+	ssize_t len = read(src, raw.buf, sizeof(raw.buf));
+	if (len < 0 && errno != EAGAIN) syslog(LOG_ERR, "read: %m");
+	if (len <= 0) return len;
+	recorderWrite(raw.buf, len);
+	if (raw.fd < 0) {
+		raw.drops += len;
+		return len;
+	}
+	raw.bytes[stream] += len;
+	raw.len = len;
+	rawWrite();
+	return len;
+}
+
+void rawRecord(void) {
+}
+
+void rawReset(void) {
+}
+
+#endif
+
+bool rawBlocked(void) {
+	return raw.blocked;
+}
+
+void rawPoll(struct pollfd *pfd, const struct timeval *now, struct timeval *deadline) {
+	if (raw.fd < 0 && timercmp(now, &raw.retry, >=)) {
+		raw.fd = rawOpen();
+		if (raw.fd < 0) {
+			timeradd(now, &Retry, &raw.retry);
+		} else if (raw.drops) {
+			syslog(LOG_WARNING, "%s: dropped %llu bytes", raw.path, raw.drops);
+			raw.drops = 0;
+		}
+	}
+	if (raw.fd < 0) deadlineMin(deadline, &raw.retry);
+	pfd->fd = (raw.blocked ? raw.fd : -1);
+	pfd->events = POLLOUT;
+}
+
+void rawEvent(short revents) {
+	if (!raw.blocked || !revents) return;
+	raw.blocked = false;
+	if (raw.len) rawWrite();
+}
+
+void rawDrain(int src, enum Stream stream) {
+	for (int i = 0; i < 16 && !raw.blocked; ++i) {
+		if (rawMove(src, stream) <= 0) break;
+	}
+}
+
+// Wait for the rest of the output to be written before exiting.
+void rawFinish(int fds[static StreamCap]) {
+	if (raw.fd < 0) return;
+	struct timeval timeout = { .tv_sec = 1 };
+	setsockopt(raw.fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	fcntl(raw.fd, F_SETFL, 0);
+	raw.blocked = false;
+	for (enum Stream i = 0; i < StreamCap; ++i) {
+		while (raw.fd >= 0 && rawMove(fds[i], i) > 0);
+	}
+}
+
+void rawInfo(void) {
+	syslog(
+		LOG_INFO, "passed %llu bytes of stdout and %llu bytes of stderr",
+		raw.bytes[Stdout], raw.bytes[Stderr]
+	);
+}
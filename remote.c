@@ -0,0 +1,340 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kitd.h"
+
+enum { QueueCap = 256 * 1024 };
+
+static const struct timeval BackoffMin = { .tv_sec = 1 };
+static const struct timeval BackoffMax = { .tv_sec = 60 };
+static const struct timeval ConnectTimeout = { .tv_sec = 10 };
+
+static struct Sink sink;
+
+static struct {
+	const char *app;
+	const char *str;
+	char host[256];
+	char *node;
+	char *service;
+	int type;
+	int fd;
+	bool connected;
+	struct timeval retry;
+	struct timeval backoff;
+	size_t drops;
+	size_t partial;
+	size_t len;
+	char buf[QueueCap];
+} remote = { .fd = -1 };
+
+void remoteInit(const char *app, const char *str) {
+	remote.app = app;
+	remote.str = str;
+	remote.backoff = BackoffMin;
+	sink.name = str;
+	sinkAdd(&sink);
+	if (gethostname(remote.host, sizeof(remote.host)) || !remote.host[0]) {
+		strcpy(remote.host, "-");
+	}
+
+	remote.type = SOCK_STREAM;
+	if (!strncmp(str, "udp:", 4)) {
+		remote.type = SOCK_DGRAM;
+		str += 4;
+	} else if (!strncmp(str, "tcp:", 4)) {
+		str += 4;
+	}
+	remote.node = strdup(str);
+	if (!remote.node) err(1, "strdup");
+	if (strchr(remote.node, '/')) return;
+
+	char *port = NULL;
+	if (remote.node[0] == '[') {
+		char *end = strchr(remote.node, ']');
+		if (!end || (end[1] && end[1] != ':')) {
+			errx(1, "invalid remote %s", remote.str);
+		}
+		remote.node++;
+		*end = '\0';
+		if (end[1]) port = &end[2];
+	} else {
+		port = strchr(remote.node, ':');
+		if (port) *port++ = '\0';
+	}
+	if (port && !*port) errx(1, "invalid remote %s", remote.str);
+	remote.service = port;
+	if (!remote.service) {
+		remote.service = (remote.type == SOCK_DGRAM ? "514" : "601");
+	}
+}
+
+static void dequeue(size_t len) {
+	remote.len -= len;
+	memmove(remote.buf, &remote.buf[len], remote.len);
+}
+
+// Frames are octet-counted as in RFC 6587: "LEN SP MSG".
+static const char *frame(const char *ptr, size_t *len) {
+	char *msg;
+	*len = strtoul(ptr, &msg, 10);
+	return &msg[1];
+}
+
+static void backoff(void) {
+	struct timeval time;
+	monotonic(&time);
+	timeradd(&time, &remote.backoff, &remote.retry);
+	timeradd(&remote.backoff, &remote.backoff, &remote.backoff);
+	if (timercmp(&remote.backoff, &BackoffMax, >)) {
+		remote.backoff = BackoffMax;
+	}
+}
+
+static void disconnect(void) {
+	close(remote.fd);
+	remote.fd = -1;
+	remote.connected = false;
+	sink.up = false;
+	// Discard the rest of a partially written frame so the next connection
+	// starts on a frame boundary.
+	dequeue(remote.partial);
+	remote.partial = 0;
+	backoff();
+}
+
+static void connected(void) {
+	remote.connected = true;
+	remote.backoff = BackoffMin;
+	sink.up = true;
+}
+
+static int connectLocal(void) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(remote.node) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, remote.node);
+	// Like syslog(3), accept either a stream or a datagram socket.
+	int types[] = { SOCK_STREAM, SOCK_DGRAM };
+	for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+		int fd = socket(AF_UNIX, types[i] | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0) return -1;
+		int error = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+		if (!error || errno == EINPROGRESS) {
+			remote.type = types[i];
+			remote.fd = fd;
+			return error;
+		}
+		int connectErrno = errno;
+		close(fd);
+		errno = connectErrno;
+		if (errno != EPROTOTYPE) break;
+	}
+	return -1;
+}
+
+static int connectRemote(void) {
+	struct addrinfo *head;
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = remote.type,
+	};
+	int error = getaddrinfo(remote.node, remote.service, &hints, &head);
+	if (error) {
+		syslog(LOG_WARNING, "%s: %s", remote.str, gai_strerror(error));
+		errno = 0;
+		return -1;
+	}
+	error = -1;
+	for (struct addrinfo *ai = head; ai; ai = ai->ai_next) {
+		int fd = socket(
+			ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			ai->ai_protocol
+		);
+		if (fd < 0) continue;
+		error = connect(fd, ai->ai_addr, ai->ai_addrlen);
+		if (!error || errno == EINPROGRESS) {
+			remote.fd = fd;
+			break;
+		}
+		int connectErrno = errno;
+		close(fd);
+		errno = connectErrno;
+	}
+	freeaddrinfo(head);
+	return error;
+}
+
+static void remoteConnect(const struct timeval *now) {
+	int error = (remote.service ? connectRemote() : connectLocal());
+	if (!error) {
+		connected();
+	} else if (errno == EINPROGRESS) {
+		timeradd(now, &ConnectTimeout, &remote.retry);
+	} else {
+		if (errno) syslog(LOG_WARNING, "%s: %m", remote.str);
+		backoff();
+	}
+}
+
+void remotePoll(struct pollfd *pfd, const struct timeval *now, struct timeval *deadline) {
+	if (remote.fd < 0 && timercmp(now, &remote.retry, >=)) {
+		remoteConnect(now);
+	} else if (
+		remote.fd >= 0 && !remote.connected && timercmp(now, &remote.retry, >=)
+	) {
+		syslog(LOG_WARNING, "%s: %s", remote.str, strerror(ETIMEDOUT));
+		disconnect();
+	}
+	pfd->fd = remote.fd;
+	pfd->events = 0;
+	if (remote.fd < 0 || !remote.connected) {
+		deadlineMin(deadline, &remote.retry);
+	}
+	if (remote.fd < 0) return;
+	if (!remote.connected || remote.len) pfd->events |= POLLOUT;
+	if (remote.connected && remote.type == SOCK_STREAM) pfd->events |= POLLIN;
+}
+
+void remoteEvent(short revents) {
+	if (remote.fd < 0 || !revents) return;
+	if (!remote.connected) {
+		int error = 0;
+		socklen_t len = sizeof(error);
+		getsockopt(remote.fd, SOL_SOCKET, SO_ERROR, &error, &len);
+		if (error) {
+			syslog(LOG_WARNING, "%s: %s", remote.str, strerror(error));
+			disconnect();
+			return;
+		}
+		connected();
+	}
+	if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		char buf[256];
+		ssize_t len = read(remote.fd, buf, sizeof(buf));
+		if (len < 0 && errno == EAGAIN) return;
+		if (len < 0) {
+			syslog(LOG_WARNING, "%s: %m", remote.str);
+		} else if (!len) {
+			syslog(LOG_WARNING, "%s: connection closed", remote.str);
+		}
+		if (len <= 0) {
+			disconnect();
+			return;
+		}
+	}
+	remoteFlush();
+}
+
+void remoteRecord(int priority, pid_t pid, const char *msg) {
+	char procid[16] = "-";
+	if (pid) snprintf(procid, sizeof(procid), "%d", (int)pid);
+
+	char buf[2048];
+	int len = snprintf(
+		buf, sizeof(buf), "<%d>1 %s %s %.48s %s - - %s",
+		LOG_DAEMON | priority, sinkStamp(), remote.host, remote.app, procid, msg
+	);
+	if ((size_t)len >= sizeof(buf)) len = sizeof(buf)-1;
+	char head[16];
+	int headLen = snprintf(head, sizeof(head), "%d ", len);
+	if (remote.len + headLen + len > sizeof(remote.buf)) remoteFlush();
+	if (remote.len + headLen + len > sizeof(remote.buf)) {
+		remote.drops++;
+		sink.drops++;
+		return;
+	}
+	memcpy(&remote.buf[remote.len], head, headLen);
+	memcpy(&remote.buf[remote.len + headLen], buf, len);
+	remote.len += headLen + len;
+	sinkQueue(&sink);
+}
+
+static ssize_t flushStream(void) {
+	ssize_t len = send(remote.fd, remote.buf, remote.len, MSG_NOSIGNAL);
+	if (len <= 0) return len;
+	if ((size_t)len <= remote.partial) {
+		remote.partial -= len;
+	} else {
+		size_t off = remote.partial;
+		while (off < (size_t)len) {
+			size_t msgLen;
+			const char *msg = frame(&remote.buf[off], &msgLen);
+			off = &msg[msgLen] - remote.buf;
+		}
+		remote.partial = off - len;
+	}
+	dequeue(len);
+	return len;
+}
+
+static ssize_t flushDatagram(void) {
+	ssize_t len = 0;
+	size_t off = 0;
+	while (off < remote.len) {
+		size_t msgLen;
+		const char *msg = frame(&remote.buf[off], &msgLen);
+		len = send(remote.fd, msg, msgLen, MSG_NOSIGNAL);
+		if (len < 0) break;
+		off = &msg[msgLen] - remote.buf;
+	}
+	dequeue(off);
+	return len;
+}
+
+void remoteFlush(void) {
+	if (!remote.connected || !remote.len) return;
+	ssize_t len = (remote.type == SOCK_DGRAM ? flushDatagram() : flushStream());
+	if (len < 0 && errno != EAGAIN && errno != ENOBUFS) {
+		syslog(LOG_WARNING, "%s: %m", remote.str);
+		disconnect();
+		return;
+	}
+	sinkWrote(&sink, !remote.len);
+	if (remote.drops) {
+		syslog(LOG_WARNING, "%s: dropped %zu records", remote.str, remote.drops);
+		remote.drops = 0;
+	}
+}
+
+// Whether to hold output in the pipes rather than risk dropping it. Output
+// is only dropped while there is no connection at all, or when other sinks
+// must not be held up.
+bool remoteBlocked(void) {
+	return sink.overflow == Block && remote.fd >= 0 && remote.len;
+}
+
+void remoteDrain(void) {
+	for (int i = 0; i < 10 && remote.connected && remote.len; ++i) {
+		struct pollfd pfd = { .fd = remote.fd, .events = POLLOUT };
+		if (poll(&pfd, 1, 100) < 0) break;
+		remoteFlush();
+	}
+}
@@ -0,0 +1,300 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <syslog.h>
+
+#include "kitd.h"
+
+// Replica mode: keep between min and max copies of command running, scaled
+// by the CPU they use between them.
+static struct {
+	size_t min;
+	size_t max;
+	size_t low;
+	size_t high;
+} scale;
+
+static const struct timeval ScaleWindow = { .tv_sec = 5 };
+static const struct timeval ScaleUp = { .tv_sec = 15 };
+static const struct timeval ScaleDown = { .tv_sec = 60 };
+
+// A rolling restart replaces step replicas at a time, waiting for each
+// replacement to stay up before going on.
+static struct {
+	bool active;
+	size_t step;
+	size_t next;
+	struct timeval uptime;
+} roll;
+
+void replicaInit(
+	size_t min, size_t max, size_t low, size_t high,
+	const struct timeval *uptime
+) {
+	// With no replica running there would be no CPU use to scale up on.
+	if (!min) errx(1, "invalid minimum 0");
+	scale.min = min;
+	scale.max = max;
+	scale.low = low;
+	scale.high = high;
+	roll.uptime = *uptime;
+}
+
+const char *rollRestart(size_t step) {
+	if (!scale.max) return "not running replicas";
+	if (roll.active) return "already restarting";
+	roll.active = true;
+	roll.step = (step ? step : 1);
+	roll.next = 0;
+	return NULL;
+}
+
+enum Roll { RollNone, RollStop, RollStart };
+
+struct Replica {
+	char tag[16];
+	bool retiring;
+	enum Roll roll;
+	struct Backoff backoff;
+	struct timeval restart;
+	struct timeval kill;
+};
+
+int replicaRun(
+	char *argv[], const char *control, const struct Backoff *backoff
+) {
+	struct Worker *workers = calloc(scale.max, sizeof(*workers));
+	struct Replica *replicas = calloc(scale.max, sizeof(*replicas));
+	size_t nfds = SlotWorkers + StreamCap * scale.max;
+	struct pollfd *fds = calloc(nfds, sizeof(*fds));
+	if (!workers || !replicas || !fds) {
+		syslog(LOG_ERR, "calloc: %m");
+		return 1;
+	}
+	for (size_t i = 0; i < nfds; ++i) {
+		fds[i] = (struct pollfd) { .fd = -1 };
+	}
+	for (size_t i = 0; i < scale.max; ++i) {
+		snprintf(replicas[i].tag, sizeof(replicas[i].tag), "%zu", i);
+		workers[i].tag = replicas[i].tag;
+		replicas[i].backoff = *backoff;
+	}
+
+	sigset_t mask;
+	sigfillset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+
+	struct timeval now;
+	monotonic(&now);
+
+	bool stop = false;
+	size_t target = scale.min;
+	size_t running = 0;
+	unsigned long long usage = 0;
+	size_t percent = 0;
+	struct timeval sampled = now;
+	struct timeval cooldown = now;
+	cgroupUsage(&usage);
+	for (;;) {
+		monotonic(&now);
+		sampleUpdate(&now);
+
+		for (int sig; 0 != (sig = signalTake());) {
+			if (sig == SIGINT || sig == SIGTERM) stop = true;
+			workersSignal(workers, scale.max, sig);
+		}
+
+		if (caught(SIGCHLD)) {
+			int status;
+			for (pid_t pid; 0 < (pid = waitpid(-1, &status, WNOHANG));) {
+				size_t i;
+				for (i = 0; i < scale.max; ++i) {
+					if (workers[i].pid == pid) break;
+				}
+				if (i == scale.max) continue;
+				PROBE2(exit, pid, status);
+				running--;
+				struct Worker *worker = &workers[i];
+				struct Replica *replica = &replicas[i];
+				struct timeval uptime;
+				timersub(&now, &worker->start, &uptime);
+				workerFinish(worker);
+				timerclear(&replica->kill);
+				if (replica->roll == RollStop && !stop) {
+					replica->roll = (roll.active ? RollStart : RollNone);
+					replica->restart = now;
+					continue;
+				}
+				if (replica->roll == RollStart) {
+					syslog(
+						LOG_WARNING, "rolling restart stopped: replica %zu failed",
+						i
+					);
+					roll.active = false;
+					for (size_t j = 0; j < scale.max; ++j) {
+						if (replicas[j].roll == RollStart) replicas[j].roll = RollNone;
+					}
+				}
+				replica->roll = RollNone;
+				if (stop || replica->retiring || i >= target) {
+					replica->retiring = false;
+					replica->restart = now;
+					continue;
+				}
+				if (WIFEXITED(status) && WEXITSTATUS(status) == 127) stop = true;
+				if (WIFEXITED(status)) {
+					syslog(
+						LOG_NOTICE, "replica %zu exited %d",
+						i, WEXITSTATUS(status)
+					);
+				} else if (WIFSIGNALED(status)) {
+					syslog(
+						LOG_NOTICE, "replica %zu got %s",
+						i, strsignal(WTERMSIG(status))
+					);
+				}
+				struct timeval interval = backoffNext(&replica->backoff, &uptime);
+				syslog(
+					LOG_INFO, "restarting replica %zu in %s",
+					i, humanize(&interval)
+				);
+				timeradd(&now, &interval, &replica->restart);
+			}
+		}
+		if (stop && !running) break;
+
+		// Scale on the CPU used per replica over the last window, at most
+		// one step at a time and not again until things have settled.
+		struct timeval elapsed;
+		timersub(&now, &sampled, &elapsed);
+		if (!stop && timercmp(&elapsed, &ScaleWindow, >=)) {
+			unsigned long long used = usage;
+			if (cgroupUsage(&usage)) {
+				syslog(LOG_WARNING, "cpu.stat: %m");
+			} else if (running) {
+				double usecs = elapsed.tv_sec * 1e6 + elapsed.tv_usec;
+				percent = 100 * (usage - used) / usecs / running;
+			} else {
+				percent = 0;
+			}
+			sampled = now;
+			// Hold the number of replicas steady while they are replaced.
+			if (!roll.active && timercmp(&now, &cooldown, >=)) {
+				if (percent > scale.high && target < scale.max) {
+					target++;
+					syslog(
+						LOG_NOTICE, "scaling up to %zu replicas at %zu%% CPU",
+						target, percent
+					);
+					timeradd(&now, &ScaleUp, &cooldown);
+				} else if (percent < scale.low && target > scale.min) {
+					target--;
+					syslog(
+						LOG_NOTICE, "scaling down to %zu replicas at %zu%% CPU",
+						target, percent
+					);
+					struct Replica *replica = &replicas[target];
+					if (workers[target].pid) {
+						replica->retiring = true;
+						timeradd(&now, &Drain, &replica->kill);
+						killpg(workers[target].pid, SIGTERM);
+					}
+					timeradd(&now, &ScaleDown, &cooldown);
+				}
+			}
+		}
+
+		struct timeval deadline;
+		timeradd(&sampled, &ScaleWindow, &deadline);
+		if (roll.active) {
+			size_t rolling = 0;
+			for (size_t i = 0; i < target; ++i) {
+				struct Replica *replica = &replicas[i];
+				if (replica->roll != RollStart || !workers[i].pid) {
+					rolling += (replica->roll != RollNone);
+					continue;
+				}
+				struct timeval up;
+				timeradd(&workers[i].start, &roll.uptime, &up);
+				if (timercmp(&now, &up, >=)) {
+					replica->roll = RollNone;
+				} else {
+					deadlineMin(&deadline, &up);
+					rolling++;
+				}
+			}
+			for (; !stop && rolling < roll.step && roll.next < target; roll.next++) {
+				size_t i = roll.next;
+				if (!workers[i].pid) continue;
+				syslog(LOG_NOTICE, "restarting replica %zu", i);
+				replicas[i].roll = RollStop;
+				timeradd(&now, &Drain, &replicas[i].kill);
+				killpg(workers[i].pid, SIGTERM);
+				rolling++;
+			}
+			if (!rolling && roll.next >= target) {
+				syslog(LOG_NOTICE, "rolling restart done");
+				roll.active = false;
+			}
+		}
+		for (size_t i = 0; i < scale.max; ++i) {
+			struct Worker *worker = &workers[i];
+			struct Replica *replica = &replicas[i];
+			if (worker->pid && timerisset(&replica->kill)) {
+				if (timercmp(&now, &replica->kill, >=)) {
+					syslog(LOG_WARNING, "killing replica %zu", i);
+					killpg(worker->pid, SIGKILL);
+					timerclear(&replica->kill);
+				} else {
+					deadlineMin(&deadline, &replica->kill);
+				}
+			}
+			if (stop || worker->pid || i >= target) continue;
+			if (timercmp(&now, &replica->restart, <)) {
+				deadlineMin(&deadline, &replica->restart);
+				continue;
+			}
+			if (workerStart(worker, argv, NULL, &now)) {
+				running++;
+			} else {
+				struct timeval retry = { .tv_sec = 1 };
+				timeradd(&now, &retry, &replica->restart);
+				deadlineMin(&deadline, &replica->restart);
+			}
+		}
+
+		if (caught(SIGINFO)) {
+			syslog(
+				LOG_INFO, "%zu of %zu replicas running, %zu%% CPU each",
+				running, target, percent
+			);
+			outputInfo();
+		}
+
+		workersPoll(fds, workers, scale.max, control, &now, &deadline);
+	}
+
+	outputDrain();
+	if (control) controlClose();
+	return 0;
+}
@@ -0,0 +1,102 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "kitd.h"
+
+enum { SinkCap = 4 };
+
+const char *StreamNames[StreamCap] = {
+	[Stdout] = "stdout",
+	[Stderr] = "stderr",
+};
+
+static struct Sink *sinks[SinkCap];
+static size_t len;
+
+void sinkAdd(struct Sink *sink) {
+	assert(len < SinkCap);
+	sinks[len++] = sink;
+	// Holding output in the pipes for one sink would hold it up for the
+	// rest, so once there are several, each drops what it cannot keep.
+	if (len < 2) return;
+	for (size_t i = 0; i < len; ++i) {
+		sinks[i]->overflow = Drop;
+	}
+}
+
+void sinkQueue(struct Sink *sink) {
+	PROBE2(submit, sink->name, sink->records);
+	sink->records++;
+	if (!timerisset(&sink->since)) monotonic(&sink->since);
+}
+
+// Latency is how long the oldest queued record waited to be written.
+void sinkWrote(struct Sink *sink, bool empty) {
+	if (!timerisset(&sink->since)) return;
+	struct timeval now, wait;
+	monotonic(&now);
+	timersub(&now, &sink->since, &wait);
+	if (timercmp(&wait, &sink->max, >)) sink->max = wait;
+	if (!empty) return;
+	timeradd(&sink->total, &wait, &sink->total);
+	sink->writes++;
+	timerclear(&sink->since);
+}
+
+const char *sinkInfo(size_t i) {
+	static char buf[512];
+	if (i >= len) return NULL;
+	const struct Sink *sink = sinks[i];
+	double total = sink->total.tv_sec * 1e3 + sink->total.tv_usec / 1e3;
+	double max = sink->max.tv_sec * 1e3 + sink->max.tv_usec / 1e3;
+	snprintf(
+		buf, sizeof(buf),
+		"%s: %s, %llu records, %llu dropped, "
+		"%.3fms average and %.3fms maximum latency",
+		sink->name, (sink->up ? "up" : "down"), sink->records, sink->drops,
+		(sink->writes ? total / sink->writes : 0.0), max
+	);
+	return buf;
+}
+
+unsigned long long sinkDrops(void) {
+	unsigned long long drops = 0;
+	for (size_t i = 0; i < len; ++i) {
+		drops += sinks[i]->drops;
+	}
+	return drops;
+}
+
+// Format the current time as in RFC 5424, once per second.
+const char *sinkStamp(void) {
+	static time_t last;
+	static char stamp[32];
+	static char buf[64];
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (now.tv_sec != last) {
+		struct tm tm;
+		gmtime_r(&now.tv_sec, &tm);
+		strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+		last = now.tv_sec;
+	}
+	snprintf(buf, sizeof(buf), "%s.%06ldZ", stamp, now.tv_nsec / 1000);
+	return buf;
+}
@@ -0,0 +1,108 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kitd.h"
+
+enum { SampleCap = 256 };
+
+static const char *StartNames[StartCap] = {
+	[StartBackoff] = "backoff",
+	[StartExec] = "exec",
+	[StartOutput] = "output",
+	[StartReady] = "ready",
+};
+
+// Times from fork to each phase of the current incarnation, and samples of
+// the most recent incarnations.
+static struct timeval forked;
+static struct timeval exited;
+static bool marked[StartCap];
+static struct {
+	size_t count;
+	unsigned long long samples[SampleCap];
+} starts[StartCap];
+
+static unsigned long long usecs(const struct timeval *tv) {
+	return tv->tv_sec * 1000000ULL + tv->tv_usec;
+}
+
+static void sample(enum Start start, const struct timeval *from, const struct timeval *to) {
+	struct timeval diff;
+	timersub(to, from, &diff);
+	starts[start].samples[starts[start].count++ % SampleCap] = usecs(&diff);
+}
+
+void startupFork(const struct timeval *now) {
+	if (timerisset(&exited)) sample(StartBackoff, &exited, now);
+	forked = *now;
+	memset(marked, 0, sizeof(marked));
+}
+
+bool startupMark(enum Start start, const struct timeval *now) {
+	if (marked[start]) return false;
+	marked[start] = true;
+	sample(start, &forked, now);
+	return true;
+}
+
+void startupExit(const struct timeval *now) {
+	exited = *now;
+}
+
+// Percentiles of a copy of the samples, returning how many there are.
+static size_t sorted(enum Start start, struct Percentiles *pct) {
+	unsigned long long buf[SampleCap];
+	size_t len = starts[start].count;
+	if (len > SampleCap) len = SampleCap;
+	memcpy(buf, starts[start].samples, len * sizeof(*buf));
+	percentiles(pct, buf, len);
+	return len;
+}
+
+// The i-th phase with any samples.
+const char *startupInfo(size_t i) {
+	static char buf[256];
+	for (enum Start start = 0; start < StartCap; ++start) {
+		if (!starts[start].count || i--) continue;
+		struct Percentiles pct;
+		sorted(start, &pct);
+		snprintf(
+			buf, sizeof(buf),
+			"%s: %zu times, p50 %.3fms, p90 %.3fms, max %.3fms",
+			StartNames[start], starts[start].count, pct.p50 / 1e3,
+			pct.p90 / 1e3, pct.max / 1e3
+		);
+		return buf;
+	}
+	return NULL;
+}
+
+// One line per phase, in microseconds.
+void startupPrint(void) {
+	for (enum Start i = 0; i < StartCap; ++i) {
+		struct Percentiles pct;
+		size_t len = sorted(i, &pct);
+		if (!len) continue;
+		printf(
+			"%s count=%zu min=%llu p50=%llu p90=%llu p99=%llu max=%llu\n",
+			StartNames[i], len, pct.min, pct.p50, pct.p90, pct.p99, pct.max
+		);
+	}
+}
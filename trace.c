@@ -0,0 +1,160 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kitd.h"
+
+enum { TraceCap = 64 * 1024, BucketCap = 32 };
+
+static const char *PhaseNames[PhaseCap] = {
+	[PhasePoll] = "poll",
+	[PhaseFill] = "fill",
+	[PhaseFlush] = "flush",
+	[PhaseSyslog] = "syslog",
+	[PhaseFork] = "fork",
+};
+
+static const char *WakeNames[WakeCap] = {
+	[WakeFd] = "fd",
+	[WakeSignal] = "signal",
+	[WakeTimer] = "timer",
+};
+
+bool tracing;
+
+static const char *tracePath;
+
+// Durations in microseconds by power of two: bucket b holds [2^(b-1), 2^b).
+static struct {
+	unsigned long long count;
+	unsigned long long total;
+	unsigned long long max;
+	unsigned long long buckets[BucketCap];
+} phases[PhaseCap];
+
+static unsigned long long wakes[WakeCap];
+
+// The most recent spans, for export as Chrome trace events.
+static struct Span {
+	unsigned long long start;
+	unsigned duration;
+	unsigned char phase;
+	unsigned char wake;
+} spans[TraceCap];
+static size_t head;
+static size_t len;
+
+void traceInit(const char *path) {
+	tracePath = path;
+	tracing = true;
+}
+
+unsigned long long traceClock(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static struct Span *span(enum Phase phase, unsigned long long start) {
+	unsigned long long duration = traceClock() - start;
+	phases[phase].count++;
+	phases[phase].total += duration;
+	if (duration > phases[phase].max) phases[phase].max = duration;
+	int b = 0;
+	while (b < BucketCap-1 && duration >> b) b++;
+	phases[phase].buckets[b]++;
+
+	struct Span *span = &spans[head];
+	*span = (struct Span) {
+		.start = start, .duration = duration, .phase = phase, .wake = WakeCap,
+	};
+	head = (head + 1) % TraceCap;
+	if (len < TraceCap) len++;
+	return span;
+}
+
+void traceSpan(enum Phase phase, unsigned long long start) {
+	span(phase, start);
+}
+
+void traceWake(unsigned long long start, enum Wake wake) {
+	span(PhasePoll, start)->wake = wake;
+	wakes[wake]++;
+}
+
+static unsigned long long percentile(enum Phase phase, unsigned p) {
+	unsigned long long want = (phases[phase].count * p + 99) / 100;
+	unsigned long long sum = 0;
+	for (int b = 0; b < BucketCap; ++b) {
+		sum += phases[phase].buckets[b];
+		if (sum >= want) {
+			return (1ULL << b < phases[phase].max ? 1ULL << b : phases[phase].max);
+		}
+	}
+	return phases[phase].max;
+}
+
+const char *traceInfo(size_t i) {
+	static char buf[256];
+	if (!tracing || i > PhaseCap) return NULL;
+	if (i == PhaseCap) {
+		snprintf(
+			buf, sizeof(buf), "wakeups: %llu fd, %llu signal, %llu timer",
+			wakes[WakeFd], wakes[WakeSignal], wakes[WakeTimer]
+		);
+		return buf;
+	}
+	snprintf(
+		buf, sizeof(buf),
+		"%s: %llu times, %.3fs total, p50 %lluus, p99 %lluus, max %lluus",
+		PhaseNames[i], phases[i].count, phases[i].total / 1e6,
+		percentile(i, 50), percentile(i, 99), phases[i].max
+	);
+	return buf;
+}
+
+int traceDump(void) {
+	if (!tracing) return -1;
+	FILE *file = fopen(tracePath, "w");
+	if (!file) {
+		syslog(LOG_WARNING, "%s: %m", tracePath);
+		return -1;
+	}
+	int pid = getpid();
+	fprintf(file, "{\"traceEvents\":[\n");
+	for (size_t i = 0; i < len; ++i) {
+		const struct Span *span = &spans[(head + TraceCap - len + i) % TraceCap];
+		fprintf(
+			file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%u,"
+			"\"pid\":%d,\"tid\":%d",
+			(i ? ",\n" : ""), PhaseNames[span->phase], span->start,
+			span->duration, pid, pid
+		);
+		if (span->wake < WakeCap) {
+			fprintf(file, ",\"args\":{\"wake\":\"%s\"}", WakeNames[span->wake]);
+		}
+		fprintf(file, "}");
+	}
+	fprintf(file, "\n]}\n");
+	int error = fclose(file);
+	if (error) syslog(LOG_WARNING, "%s: %m", tracePath);
+	return error;
+}
@@ -0,0 +1,243 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "kitd.h"
+
+enum { WatchCap = 16 };
+
+// Changes must settle for this long before the files are checked, so that a
+// file being copied into place is not taken half written.
+static const struct timeval Settle = { .tv_sec = 1 };
+static const struct timeval Interval = { .tv_sec = 2 };
+
+static struct {
+	size_t len;
+	struct {
+		char *path;
+		char *base;
+		bool exec;
+		bool pending;
+		int wd;
+		struct stat st;
+	} files[WatchCap];
+	int fd;
+	struct timeval settle;
+	struct timeval check;
+} watch = { .fd = -1 };
+
+static void watchAdd(char *path, bool exec) {
+	if (watch.len == WatchCap) errx(1, "too many files to watch");
+	for (size_t i = 0; i < watch.len; ++i) {
+		if (!strcmp(watch.files[i].path, path)) return;
+	}
+	struct stat st;
+	if (stat(path, &st)) err(1, "%s", path);
+	char *copy = strdup(path);
+	if (!copy) err(1, "strdup");
+	watch.files[watch.len].path = path;
+	watch.files[watch.len].base = strdup(basename(copy));
+	if (!watch.files[watch.len].base) err(1, "strdup");
+	free(copy);
+	watch.files[watch.len].exec = exec;
+	watch.files[watch.len].wd = -1;
+	watch.files[watch.len].st = st;
+	watch.len++;
+}
+
+// Watch both a path and what it links to, since either may be replaced.
+static void watchLinks(const char *path, bool exec) {
+	char *real = realpath(path, NULL);
+	if (!real) err(1, "%s", path);
+	if (path[0] == '/' && strcmp(path, real)) {
+		char *copy = strdup(path);
+		if (!copy) err(1, "strdup");
+		watchAdd(copy, exec);
+	}
+	watchAdd(real, exec);
+}
+
+void watchFile(const char *path) {
+	watchLinks(path, false);
+}
+
+// The executable as found in PATH.
+void watchExec(const char *name) {
+	char *found = NULL;
+	if (strchr(name, '/')) {
+		found = strdup(name);
+		if (!found) err(1, "strdup");
+	} else {
+		const char *path = getenv("PATH");
+		if (!path) path = "/usr/bin:/bin";
+		for (const char *dir = path; !found && *dir;) {
+			size_t len = strcspn(dir, ":");
+			char *try;
+			int n = asprintf(
+				&try, "%.*s/%s", (int)len, (len ? dir : "."), name
+			);
+			if (n < 0) err(1, "asprintf");
+			if (!access(try, X_OK)) {
+				found = try;
+			} else {
+				free(try);
+			}
+			dir += len;
+			if (*dir) dir++;
+		}
+		if (!found) errx(1, "%s: not found in PATH", name);
+	}
+	watchLinks(found, true);
+	free(found);
+}
+
+void watchInit(void) {
+#ifdef __linux__
+	watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch.fd < 0) {
+		syslog(LOG_WARNING, "inotify_init1: %m");
+		return;
+	}
+	// Watch directories, since files are usually replaced by rename(2).
+	for (size_t i = 0; i < watch.len; ++i) {
+		char *copy = strdup(watch.files[i].path);
+		if (!copy) err(1, "strdup");
+		watch.files[i].wd = inotify_add_watch(
+			watch.fd, dirname(copy),
+			IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+			IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO
+		);
+		if (watch.files[i].wd < 0) err(1, "%s", copy);
+		free(copy);
+	}
+#endif
+}
+
+static bool same(const struct stat *a, const struct stat *b) {
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino
+		&& a->st_size == b->st_size
+		&& a->st_mtim.tv_sec == b->st_mtim.tv_sec
+		&& a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// Only an executable with a whole header is worth restarting into.
+static bool runnable(const char *path) {
+	if (access(path, X_OK)) return false;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return false;
+	char magic[4];
+	ssize_t len = read(fd, magic, sizeof(magic));
+	close(fd);
+	if (len >= 4 && !memcmp(magic, "\177ELF", 4)) return true;
+	return len >= 2 && !memcmp(magic, "#!", 2);
+}
+
+void watchPoll(struct pollfd *pfd, const struct timeval *now, struct timeval *deadline) {
+	pfd->fd = watch.fd;
+	pfd->events = POLLIN;
+	if (watch.fd < 0 && !timerisset(&watch.check)) {
+		timeradd(now, &Interval, &watch.check);
+	}
+	if (timerisset(&watch.check)) deadlineMin(deadline, &watch.check);
+	if (timerisset(&watch.settle)) deadlineMin(deadline, &watch.settle);
+}
+
+static void settle(const struct timeval *now) {
+	timeradd(now, &Settle, &watch.settle);
+}
+
+void watchEvent(short revents, const struct timeval *now) {
+#ifdef __linux__
+	if (!revents) return;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	while (0 < (len = read(watch.fd, buf, sizeof(buf)))) {
+		const struct inotify_event *event;
+		for (char *ptr = buf; ptr < &buf[len]; ptr += sizeof(*event) + event->len) {
+			event = (const struct inotify_event *)ptr;
+			for (size_t i = 0; i < watch.len; ++i) {
+				if (event->wd != watch.files[i].wd || !event->len) continue;
+				if (!strcmp(event->name, watch.files[i].base)) settle(now);
+			}
+		}
+	}
+	if (len < 0 && errno != EAGAIN) syslog(LOG_WARNING, "inotify: %m");
+#else
+	(void)revents;
+	(void)now;
+#endif
+}
+
+// Whether a watched file has changed and settled since last time. Changes
+// are kept per file until the restart, so one held back by a missing or
+// broken executable is not lost.
+bool watchChanged(const struct timeval *now) {
+	if (timerisset(&watch.check) && timercmp(now, &watch.check, >=)) {
+		timerclear(&watch.check);
+		for (size_t i = 0; i < watch.len; ++i) {
+			struct stat st;
+			if (stat(watch.files[i].path, &st)) continue;
+			if (!same(&st, &watch.files[i].st)) settle(now);
+		}
+	}
+	if (!timerisset(&watch.settle) || timercmp(now, &watch.settle, <)) {
+		return false;
+	}
+	timerclear(&watch.settle);
+	bool changed = false;
+	bool broken = false;
+	for (size_t i = 0; i < watch.len; ++i) {
+		struct stat st;
+		if (stat(watch.files[i].path, &st)) {
+			if (!watch.files[i].exec) continue;
+			syslog(LOG_WARNING, "%s: %m", watch.files[i].path);
+			broken = true;
+			continue;
+		}
+		if (!same(&st, &watch.files[i].st)) {
+			watch.files[i].st = st;
+			watch.files[i].pending = true;
+			syslog(LOG_NOTICE, "%s changed", watch.files[i].path);
+		}
+		if (watch.files[i].pending) changed = true;
+		// Hold every change until the executable can be run again.
+		if (watch.files[i].exec && !runnable(watch.files[i].path)) {
+			syslog(LOG_WARNING, "%s: not executable", watch.files[i].path);
+			broken = true;
+		}
+	}
+	if (!changed || broken) return false;
+	for (size_t i = 0; i < watch.len; ++i) {
+		watch.files[i].pending = false;
+	}
+	return true;
+}
@@ -0,0 +1,444 @@
+/* Copyright (C) 2023  June McEnroe <june@causal.agency>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "kitd.h"
+
+static const int Priorities[StreamCap] = {
+	[Stdout] = LOG_INFO,
+	[Stderr] = LOG_NOTICE,
+};
+
+// Substitute item for each {} in the arguments, or append it if there are
+// none.
+static void workExec(char *argv[], const char *item) {
+	size_t argc = 0;
+	while (argv[argc]) argc++;
+	char **args = calloc(argc + 2, sizeof(*args));
+	if (!args) err(127, "calloc");
+	bool found = false;
+	for (size_t i = 0; i < argc; ++i) {
+		size_t n = 0;
+		for (const char *p = argv[i]; NULL != (p = strstr(p, "{}")); p += 2) n++;
+		args[i] = argv[i];
+		if (!n) continue;
+		found = true;
+		args[i] = malloc(strlen(argv[i]) + n * strlen(item) + 1);
+		if (!args[i]) err(127, "malloc");
+		char *ptr = args[i];
+		for (const char *p = argv[i], *brace; *p; p = &brace[2]) {
+			brace = strstr(p, "{}");
+			if (!brace) {
+				strcpy(ptr, p);
+				break;
+			}
+			memcpy(ptr, p, brace - p);
+			ptr += brace - p;
+			ptr = stpcpy(ptr, item);
+		}
+	}
+	if (!found) args[argc] = (char *)item;
+	execvp(args[0], args);
+	err(127, "%s", args[0]);
+}
+
+// Start a child with pipes of its own, logging its output tagged. Any item
+// is substituted into the arguments.
+bool workerStart(
+	struct Worker *worker, char *argv[], const char *item,
+	const struct timeval *now
+) {
+	int rw[StreamCap][2];
+	for (enum Stream i = 0; i < StreamCap; ++i) {
+		int error = pipe2(rw[i], O_CLOEXEC);
+		if (!error) continue;
+		syslog(LOG_ERR, "pipe2: %m");
+		for (enum Stream j = 0; j < i; ++j) {
+			close(rw[j][0]);
+			close(rw[j][1]);
+		}
+		return false;
+	}
+	pid_t pid = fork();
+	if (pid < 0) {
+		syslog(LOG_ERR, "fork: %m");
+		for (enum Stream i = 0; i < StreamCap; ++i) {
+			close(rw[i][0]);
+			close(rw[i][1]);
+		}
+		return false;
+	}
+	if (!pid) {
+		setpgid(0, 0);
+		dup2(rw[Stdout][1], STDOUT_FILENO);
+		dup2(rw[Stderr][1], STDERR_FILENO);
+		signal(SIGPIPE, SIG_DFL);
+		sigset_t unmask;
+		sigemptyset(&unmask);
+		sigprocmask(SIG_SETMASK, &unmask, NULL);
+		cgroupJoin();
+		oomAdjust();
+		if (item) workExec(argv, item);
+		execvp(argv[0], argv);
+		err(127, "%s", argv[0]);
+	}
+	PROBE1(fork, pid);
+	worker->pid = pid;
+	worker->start = *now;
+	for (enum Stream i = 0; i < StreamCap; ++i) {
+		close(rw[i][1]);
+		fcntl(rw[i][0], F_SETFL, O_NONBLOCK);
+		worker->fds[i] = rw[i][0];
+		worker->lbs[i].len = 0;
+		worker->lbs[i].tag = worker->tag;
+		worker->lbs[i].pid = pid;
+	}
+	return true;
+}
+
+// Log the rest of the output, including an unterminated last line.
+void workerFinish(struct Worker *worker) {
+	for (enum Stream i = 0; i < StreamCap; ++i) {
+		struct LineBuffer *lb = &worker->lbs[i];
+		if (worker->fds[i] >= 0) {
+			lbFinish(lb, worker->fds[i], i, Priorities[i]);
+			close(worker->fds[i]);
+			worker->fds[i] = -1;
+		}
+		if (lb->len) {
+			lb->buf[lb->len++] = '\n';
+			lbFlush(lb, i, Priorities[i]);
+		}
+	}
+	worker->pid = 0;
+}
+
+void workersSignal(struct Worker *workers, size_t len, int sig) {
+	for (size_t i = 0; i < len; ++i) {
+		if (workers[i].pid) killpg(workers[i].pid, sig);
+	}
+}
+
+// Wait on the destinations and the output of each worker.
+void workersPoll(
+	struct pollfd *fds, struct Worker *workers, size_t len,
+	const char *control, const struct timeval *now, struct timeval *deadline
+) {
+	short events = (outputPoll(&fds[SlotRemote], now, deadline) ? POLLIN : 0);
+	if (control) controlPoll(&fds[SlotControl]);
+	for (size_t i = 0; i < len; ++i) {
+		for (enum Stream j = 0; j < StreamCap; ++j) {
+			struct pollfd *pfd = &fds[SlotWorkers + StreamCap * i + j];
+			pfd->fd = (workers[i].pid ? workers[i].fds[j] : -1);
+			pfd->events = events;
+		}
+	}
+
+	struct timespec timeout;
+	if (timerisset(deadline)) {
+		struct timeval wait = {0};
+		if (timercmp(deadline, now, >)) timersub(deadline, now, &wait);
+		TIMEVAL_TO_TIMESPEC(&wait, &timeout);
+	}
+	sigset_t unmask;
+	sigemptyset(&unmask);
+	int n = ppoll(
+		fds, SlotWorkers + StreamCap * len,
+		(timerisset(deadline) ? &timeout : NULL), &unmask
+	);
+	if (n < 0 && errno != EINTR) {
+		syslog(LOG_ERR, "poll: %m");
+		return;
+	}
+	for (size_t i = 0; n > 0 && i < len; ++i) {
+		for (enum Stream j = 0; j < StreamCap; ++j) {
+			struct pollfd *pfd = &fds[SlotWorkers + StreamCap * i + j];
+			if (pfd->fd < 0 || !pfd->revents) continue;
+			lbDrain(&workers[i].lbs[j], pfd->fd, j, Priorities[j]);
+			// Close at EOF, or the hang up would keep waking ppoll(2)
+			// before SIGCHLD could be delivered.
+			if (pfd->revents == POLLHUP) {
+				close(pfd->fd);
+				workers[i].fds[j] = -1;
+			}
+		}
+	}
+	outputEvent(&fds[SlotRemote], n);
+	if (control && n >= 0) controlEvent(&fds[SlotControl]);
+}
+
+// Work queue mode: run command once per item, several at a time.
+static struct {
+	size_t parallel;
+	unsigned attempts;
+	bool stop;
+	size_t len;
+	struct Item {
+		char *str;
+		unsigned attempts;
+		bool waiting;
+		struct timeval ready;
+		struct timeval duration;
+	} *items;
+} work;
+
+void workInit(const char *path, size_t parallel, unsigned attempts) {
+	if (!attempts) errx(1, "invalid attempts 0");
+	work.parallel = parallel;
+	work.attempts = attempts;
+	FILE *file = (strcmp(path, "-") ? fopen(path, "r") : stdin);
+	if (!file) err(1, "%s", path);
+	size_t cap = 0;
+	char *line = NULL;
+	size_t lineCap = 0;
+	for (ssize_t len; 0 < (len = getline(&line, &lineCap, file));) {
+		if (line[len-1] == '\n') line[--len] = '\0';
+		if (!len) continue;
+		if (work.len == cap) {
+			cap = (cap ? 2 * cap : 256);
+			work.items = realloc(work.items, cap * sizeof(*work.items));
+			if (!work.items) err(1, "realloc");
+		}
+		work.items[work.len] = (struct Item) { .str = strdup(line) };
+		if (!work.items[work.len].str) err(1, "strdup");
+		work.len++;
+	}
+	if (ferror(file)) err(1, "%s", path);
+	free(line);
+	if (file != stdin) fclose(file);
+}
+
+static bool workStart(
+	struct Worker *worker, struct Item *item, char *argv[],
+	const struct timeval *now
+) {
+	worker->tag = item->str;
+	if (!workerStart(worker, argv, item->str, now)) return false;
+	worker->item = item;
+	item->attempts++;
+	item->waiting = false;
+	return true;
+}
+
+// Decide whether to retry.
+static bool workFinish(
+	struct Worker *worker, int status, const struct timeval *now,
+	const struct timeval *restart, const struct timeval *maximum
+) {
+	workerFinish(worker);
+	struct Item *item = worker->item;
+	timersub(now, &worker->start, &item->duration);
+	if (WIFEXITED(status) && !WEXITSTATUS(status)) return true;
+	if (WIFEXITED(status)) {
+		syslog(LOG_NOTICE, "%s: exited %d", item->str, WEXITSTATUS(status));
+	} else if (WIFSIGNALED(status)) {
+		syslog(
+			LOG_NOTICE, "%s: got %s", item->str, strsignal(WTERMSIG(status))
+		);
+	}
+	if (work.stop) return true;
+	if (item->attempts >= work.attempts) {
+		syslog(
+			LOG_WARNING, "%s: failed after %u attempts",
+			item->str, item->attempts
+		);
+		return true;
+	}
+	struct timeval interval = *restart;
+	for (unsigned i = 1; i < item->attempts; ++i) {
+		timeradd(&interval, &interval, &interval);
+		if (timercmp(&interval, maximum, >)) {
+			interval = *maximum;
+			break;
+		}
+	}
+	syslog(LOG_INFO, "%s: retrying in %s", item->str, humanize(&interval));
+	timeradd(now, &interval, &item->ready);
+	item->waiting = true;
+	return false;
+}
+
+static void workStats(
+	const struct timeval *elapsed, size_t succeeded, size_t failed
+) {
+	unsigned long long *usecs = calloc(work.len, sizeof(*usecs));
+	if (!usecs) {
+		syslog(LOG_ERR, "calloc: %m");
+		return;
+	}
+	size_t len = 0;
+	for (size_t i = 0; i < work.len; ++i) {
+		struct Item *item = &work.items[i];
+		if (!item->attempts) continue;
+		usecs[len++] = item->duration.tv_sec * 1000000ULL
+			+ item->duration.tv_usec;
+	}
+	size_t retries = 0;
+	for (size_t i = 0; i < work.len; ++i) {
+		if (work.items[i].attempts > 1) retries += work.items[i].attempts - 1;
+	}
+	double secs = elapsed->tv_sec + elapsed->tv_usec / 1e6;
+	syslog(
+		LOG_INFO, "ran %zu of %zu items in %s, %.1f per second",
+		len, work.len, humanize(elapsed), (secs > 0 ? len / secs : 0)
+	);
+	syslog(
+		LOG_INFO, "%zu succeeded, %zu failed, %zu retries",
+		succeeded, failed, retries
+	);
+	if (len) {
+		struct Percentiles pct;
+		percentiles(&pct, usecs, len);
+		syslog(
+			LOG_INFO, "duration: p50 %.3fs, p90 %.3fs, p99 %.3fs, max %.3fs",
+			pct.p50 / 1e6, pct.p90 / 1e6, pct.p99 / 1e6, pct.max / 1e6
+		);
+	}
+	free(usecs);
+}
+
+int workRun(
+	char *argv[], const char *control,
+	const struct timeval *restart, const struct timeval *maximum
+) {
+	struct Worker *workers = calloc(work.parallel, sizeof(*workers));
+	if (!workers) {
+		syslog(LOG_ERR, "calloc: %m");
+		return 1;
+	}
+	size_t nfds = SlotWorkers + StreamCap * work.parallel;
+	struct pollfd *fds = calloc(nfds, sizeof(*fds));
+	if (!fds) {
+		syslog(LOG_ERR, "calloc: %m");
+		return 1;
+	}
+	for (size_t i = 0; i < nfds; ++i) {
+		fds[i] = (struct pollfd) { .fd = -1 };
+	}
+
+	sigset_t mask;
+	sigfillset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+
+	struct timeval begin;
+	monotonic(&begin);
+
+	size_t next = 0;
+	size_t running = 0;
+	size_t waiting = 0;
+	size_t succeeded = 0;
+	size_t failed = 0;
+	for (;;) {
+		struct timeval now;
+		monotonic(&now);
+		sampleUpdate(&now);
+
+		for (int sig; 0 != (sig = signalTake());) {
+			if (sig == SIGINT || sig == SIGTERM) work.stop = true;
+			workersSignal(workers, work.parallel, sig);
+		}
+
+		if (caught(SIGCHLD)) {
+			int status;
+			for (pid_t pid; 0 < (pid = waitpid(-1, &status, WNOHANG));) {
+				struct Worker *worker = NULL;
+				for (size_t i = 0; i < work.parallel; ++i) {
+					if (workers[i].pid == pid) worker = &workers[i];
+				}
+				if (!worker) continue;
+				PROBE2(exit, pid, status);
+				running--;
+				bool ok = WIFEXITED(status) && !WEXITSTATUS(status);
+				if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+					work.stop = true;
+				}
+				if (!workFinish(worker, status, &now, restart, maximum)) {
+					waiting++;
+				} else if (ok) {
+					succeeded++;
+				} else {
+					failed++;
+				}
+			}
+		}
+
+		if (work.stop && !running) break;
+		if (next == work.len && !running && !waiting) break;
+
+		struct timeval deadline = {0};
+		for (size_t i = 0; !work.stop && i < work.parallel; ++i) {
+			if (workers[i].pid) continue;
+			struct Item *item = NULL;
+			for (size_t j = 0; waiting && j < next; ++j) {
+				if (!work.items[j].waiting) continue;
+				if (timercmp(&now, &work.items[j].ready, >=)) {
+					item = &work.items[j];
+					break;
+				}
+			}
+			if (item) {
+				waiting--;
+			} else if (next < work.len) {
+				item = &work.items[next++];
+			} else {
+				break;
+			}
+			if (!workStart(&workers[i], item, argv, &now)) {
+				struct timeval retry = { .tv_sec = 1 };
+				timeradd(&now, &retry, &item->ready);
+				item->waiting = true;
+				waiting++;
+				break;
+			}
+			running++;
+		}
+		for (size_t j = 0; waiting && j < next; ++j) {
+			if (work.items[j].waiting) {
+				deadlineMin(&deadline, &work.items[j].ready);
+			}
+		}
+
+		if (caught(SIGINFO)) {
+			syslog(
+				LOG_INFO, "finished %zu of %zu items, %zu failed, "
+				"%zu running, %zu waiting to retry",
+				succeeded + failed, work.len, failed, running, waiting
+			);
+			outputInfo();
+		}
+
+		workersPoll(fds, workers, work.parallel, control, &now, &deadline);
+	}
+
+	struct timeval now, elapsed;
+	monotonic(&now);
+	timersub(&now, &begin, &elapsed);
+	workStats(&elapsed, succeeded, failed);
+	outputDrain();
+	if (control) controlClose();
+	return (work.stop || failed ? 1 : 0);
+}